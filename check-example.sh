@@ -0,0 +1,3 @@
+#!/bin/sh
+# The example panel shipped with rcrpanel must pass the design rule check
+exec ./rcrpanel --check "${srcdir:-.}/rcrpanel.txt"
@@ -33,6 +33,10 @@
  *
  *    If the argument is omitted, a default panel is drawn.
  *
+ *    rcrpanel --serve <socket> [--workers=n]
+ *
+ *    runs as a render daemon on a Unix domain socket, see servePanels().
+ *
  * The input file is a text file containing lines each describing a
  * particular aspect of the panel.  If a particular aspect is not provided,
  * a default value is used.
@@ -134,9 +138,34 @@
  *
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
+#define REVISION "3.6.1"
+
+/* Initial table sizes, the tables grow as needed */
 #define MAXDIALS 20
 #define MAXCONTROLS 50
 #define MAXLINES 100
@@ -145,16 +174,15 @@
 
 #define COLORREF long
 
-int nNumControls;
-struct
+typedef struct
 {
 	double x;
 	double y;
 	double diam;
-} rcControl[MAXCONTROLS];
+	int nLine;
+} RCCONTROL;
 
-int nNumDials;
-struct
+typedef struct
 {
 	double x0;
 	double y0;
@@ -172,28 +200,28 @@ struct
 	double fStartingIndicator;
 	double fIncrementPerBigTick;
 	double fStartAngle;
-} rcDial[MAXDIALS];
+	int nLine;
+} RCDIAL;
 
-int nNumRectangles;
-struct
+typedef struct
 {
 	double x0;
 	double y0;
 	double fRectangleHeight;
 	double fRectangleWidth;
-} rcRectangle[MAXRECTANGLES];
+	int nLine;
+} RCRECTANGLE;
 
-int nNumCtrRectangles;
-struct
+typedef struct
 {
 	double x;
 	double y;
 	double fRectangleHeight;
 	double fRectangleWidth;
-} rcRectCenter[MAXRECTANGLES];
+	int nLine;
+} RCRECTCENTER;
 
-int nNumStrings;
-struct
+typedef struct
 {
 	double x;
 	double y;
@@ -201,7 +229,27 @@ struct
 	COLORREF crColor;
 	char szFont[32];
 	char szString[128];
-} rcText[MAXSTRINGS];
+	int nLine;
+} RCTEXT;
+
+/* Each table always has room for one more entry than it holds */
+int nNumControls, nMaxControls;
+RCCONTROL *rcControl;
+
+int nNumDials, nMaxDials;
+RCDIAL *rcDial;
+
+int nNumRectangles, nMaxRectangles;
+RCRECTANGLE *rcRectangle;
+
+int nNumCtrRectangles, nMaxCtrRectangles;
+RCRECTCENTER *rcRectCenter;
+
+int nNumStrings, nMaxStrings;
+RCTEXT *rcText;
+
+int nLineNumber;                /* Script line being read */
+int nGeometryBuilt;             /* buildGeometry() done for these tables */
 
 double fPanelHeight;
 double fPanelWidth;
@@ -213,226 +261,62 @@ COLORREF crBackground;
 int nReverse;
 
 char szBuffer[2048];
+size_t nBufferLen;              /* Length of the output line in szBuffer */
 
-/* Bump up the control number, error if too big */
-void incrementControlCount( void )
-{
-	nNumControls++;
-	if ( nNumControls >= MAXCONTROLS )
-	{
-		fprintf(stderr, "*** Error, maximum of %d controls exceeded. ***\n", MAXCONTROLS);
-		nNumControls = MAXCONTROLS - 1;
-	}
-}
+FILE *fOut;                     /* Where the PostScript goes */
+FILE *fLog;                     /* Where parse diagnostics go */
 
-/* Bump up the rectangle number, error if too big */
+/* Compact coordinates, see addLine() */
+int nCompact;
+double fResolution = 2540.0;    /* Device dots per inch */
+int nCompactDigits;             /* Decimal places kept */
+double fCompactScale;           /* 10^nCompactDigits */
+_Thread_local long long nCurX, nCurY;  /* Current point in compact units */
+long nBytesOut;                 /* PostScript written so far */
+_Thread_local long nBytesSaved; /* Bytes saved over full precision */
 
-void incrementRectangleCount( void )
+/* Output of one element drawn on a render thread, see emitParallel() */
+typedef struct
 {
-	nNumRectangles++;
-	if ( (nNumRectangles + nNumCtrRectangles) >= MAXRECTANGLES )
-	{
-		fprintf(stderr, "*** Error, maximum of %d rectangles exceeded. ***\n", MAXRECTANGLES);
-		nNumRectangles = MAXRECTANGLES - 1;
-	}
-}
+	char *pText;                /* addBuffer() tokens, each ending in a NUL */
+	size_t nText, nSize;
+	long nSaved;
+	int nDone;
+} FRAGMENT;
 
-/* Read the input file */
-void getFile( FILE *f )
+_Thread_local FRAGMENT *pFragment;  /* Set while drawing into a fragment */
+FRAGMENT *pElementCache;        /* Elements already drawn, by element number */
+int nThreads = 1;               /* Render threads for one panel */
+int nTilePaper = -1;            /* Paper for --tile, -1 for one page */
+double fTileOverlap = 10.0;     /* Tiles overlap by this much, mm */
+
+/* Make sure a table has room for entry n, the new entries are zeroed */
+void *growTable( void *p, int *pnMax, int n, int nInitial, size_t nSize )
 {
-	int nProcessedOK;
+	int nOld;
 
-	while ( !feof(f) )
+	if ( p != NULL && n < *pnMax )
+		return p;
+	nOld = p == NULL ? 0 : *pnMax;
+	*pnMax = nOld ? nOld : nInitial;
+	while ( n >= *pnMax )
+		*pnMax *= 2;
+	p = realloc(p, *pnMax * nSize);
+	if ( p == NULL )
 	{
-		fgets(szBuffer, sizeof(szBuffer), f);
-		if ( !feof(f) )
-		{
-			if ( szBuffer[strlen(szBuffer) - 1] < '!' )
-				szBuffer[strlen(szBuffer) - 1] = '\0';
-			if ( szBuffer[strlen(szBuffer) - 1] < '!' )
-				szBuffer[strlen(szBuffer) - 1] = '\0';
-			nProcessedOK = 0;
-			if ( nNumDials > 0 )
-			{
-				nProcessedOK = 1;
-				if ( !strncmp("Radius", szBuffer, 6) )
-				{
-					sscanf(&szBuffer[8], "%lf", &rcDial[nNumDials - 1].fRadius);
-					fprintf(stderr, "                     Radius: %lf\n", rcDial[nNumDials - 1].fRadius);
-				}
-				else if ( !strncmp("Span", szBuffer, 4) )
-				{
-					sscanf(&szBuffer[6], "%lf", &rcDial[nNumDials - 1].fSpan);
-					fprintf(stderr, "                       Span: %lf\n", rcDial[nNumDials - 1].fSpan);
-				}
-				else if ( !strncmp("NumTicks", szBuffer, 8) )
-				{
-					sscanf(&szBuffer[10], "%d", &rcDial[nNumDials - 1].nNumTicks);
-					fprintf(stderr, "       Number of Tick marks: %d\n", rcDial[nNumDials - 1].nNumTicks);
-				}
-				else if ( !strncmp("BigPer", szBuffer, 6) )
-				{
-					sscanf(&szBuffer[8], "%d", &rcDial[nNumDials - 1].nBigPer);
-					fprintf(stderr, "        Small ticks per big: %d\n", rcDial[nNumDials - 1].nBigPer);
-				}
-				else if ( !strncmp("SizeTicks", szBuffer, 9) )
-				{
-					sscanf(&szBuffer[11], "%lf", &rcDial[nNumDials - 1].fSizeTicks);
-					fprintf(stderr, "   Size of small tick marks: %lf\n", rcDial[nNumDials - 1].fSizeTicks);
-				}
-				else if ( !strncmp("SizeBig", szBuffer, 7) )
-				{
-					sscanf(&szBuffer[9], "%lf", &rcDial[nNumDials - 1].fSizeBig);
-					fprintf(stderr, "     Size of big tick marks: %lf\n", rcDial[nNumDials - 1].fSizeBig);
-				}
-				else if ( !strncmp("StartingIndicator", szBuffer, 17) )
-				{
-					sscanf(&szBuffer[19], "%lf", &rcDial[nNumDials - 1].fStartingIndicator);
-					fprintf(stderr, "         Starting indicator: %lf\n", rcDial[nNumDials - 1].fStartingIndicator);
-				}
-				else if ( !strncmp("IncrementPerBigTick", szBuffer, 19) )
-				{
-					sscanf(&szBuffer[21], "%lf", &rcDial[nNumDials - 1].fIncrementPerBigTick);
-					fprintf(stderr, "Increment per big tick mark: %lf\n", rcDial[nNumDials - 1].fIncrementPerBigTick);
-				}
-				else if ( !strncmp("SizeFont", szBuffer, 8) )
-				{
-					sscanf(&szBuffer[11], "%lf", &rcDial[nNumDials - 1].fSizeFont);
-					fprintf(stderr, "            Size of numbers: %lf\n", rcDial[nNumDials - 1].fSizeFont);
-				}
-				else if ( !strncmp("ColorCircle", szBuffer, 11) )
-				{
-					sscanf(&szBuffer[13], "%lx", &rcDial[nNumDials - 1].crCircle);
-					fprintf(stderr, "            Color of circle: 0x%06lx\n", rcDial[nNumDials - 1].crCircle);
-				}
-				else if ( !strncmp("ColorTickMarks", szBuffer, 14) )
-				{
-					sscanf(&szBuffer[16], "%lx", &rcDial[nNumDials - 1].crTickMarks);
-					fprintf(stderr, "  Color of small tick marks: 0x%06lx\n", rcDial[nNumDials - 1].crTickMarks);
-				}
-				else if ( !strncmp("ColorBigTickMarks", szBuffer, 17) )
-				{
-					sscanf(&szBuffer[19], "%lx", &rcDial[nNumDials - 1].crBigTickMarks);
-					fprintf(stderr, "    Color of big tick marks: 0x%06lx\n", rcDial[nNumDials - 1].crBigTickMarks);
-				}
-				else if ( !strncmp("ColorText", szBuffer, 9) )
-				{
-					sscanf(&szBuffer[11], "%lx", &rcDial[nNumDials - 1].crText);
-					fprintf(stderr, "           Color of numbers: 0x%06lx\n", rcDial[nNumDials - 1].crText);
-				}
-				else if ( !strncmp("StartAngle", szBuffer, 4) )
-				{
-					sscanf(&szBuffer[12], "%lf", &rcDial[nNumDials - 1].fStartAngle);
-					fprintf(stderr, "                Start Angle: %lf\n", rcDial[nNumDials - 1].fStartAngle);
-				}
-				else
-					nProcessedOK = 0;
-			}
-			if ( !strncmp("Reverse", szBuffer, 7) )	/* Print in reverse? */
-			{
-				nReverse = 1;
-				fprintf(stderr, "                    Reverse: TRUE\n");
-			}
-			else if ( !strncmp("/*", szBuffer, 2) || !strncmp("/**", szBuffer, 3) ) /* Comments */
-			{
-				// fprintf (stderr, "*** here a comment ***\r\n");
-			}
-			else if ( !strncmp("Dial", szBuffer, 4) ) /* Dials */
-			{
-				sscanf(&szBuffer[6], "%lf %lf", &rcDial[nNumDials].x0, &rcDial[nNumDials].y0);
-				fprintf(stderr, "===New dial (%d) at %f,%f\r\n", nNumDials + 1, rcDial[nNumDials].x0, rcDial[nNumDials].y0);
-				nNumDials++;
-			}
-			else if ( !strncmp("ControlLarge", szBuffer, 12) ) /* Large pots etc. */
-			{
-				sscanf(&szBuffer[14], "%lf %lf", &rcControl[nNumControls].x, &rcControl[nNumControls].y);
-				rcControl[nNumControls].diam = 9.35;
-				incrementControlCount();
-			}
-			else if ( !strncmp("ControlPhone", szBuffer, 12) ) /* 1/4" phone jack */
-			{
-				sscanf(&szBuffer[14], "%lf %lf", &rcControl[nNumControls].x, &rcControl[nNumControls].y);
-				rcControl[nNumControls].diam = 8.8;
-				incrementControlCount();
-			}
-			else if ( !strncmp("ControlLED", szBuffer, 10) ) /* 5mm LED holder */
-			{
-				sscanf(&szBuffer[12], "%lf %lf", &rcControl[nNumControls].x, &rcControl[nNumControls].y);
-				rcControl[nNumControls].diam = 6.0;
-				incrementControlCount();
-			}
-			else if ( !strncmp("ControlSmall", szBuffer, 12) ) /* 3.5 mm phone jack */
-			{
-				sscanf(&szBuffer[14], "%lf %lf", &rcControl[nNumControls].x, &rcControl[nNumControls].y);
-				rcControl[nNumControls].diam = 5.75;
-				incrementControlCount();
-			}
-			else if ( !strncmp("ControlTiny", szBuffer, 11) ) /* 2.5 mm phone jack */
-			{
-				sscanf(&szBuffer[13], "%lf %lf", &rcControl[nNumControls].x, &rcControl[nNumControls].y);
-				rcControl[nNumControls].diam = 3.8;
-				incrementControlCount();
-			}
-			else if ( !strncmp("ControlMicro", szBuffer, 12) ) /* 3 mm LED hole */
-			{
-				sscanf(&szBuffer[14], "%lf %lf", &rcControl[nNumControls].x, &rcControl[nNumControls].y);
-				rcControl[nNumControls].diam = 2.6;
-				incrementControlCount();
-			}
-			else if (!strncmp("Rectangle", szBuffer, 9) )	/* Rectangle */
-			{
-				sscanf(&szBuffer[11], "%lf %lf %lf %lf", &rcRectangle[nNumRectangles].x0, &rcRectangle[nNumRectangles].y0, &rcRectangle[nNumRectangles].fRectangleWidth, &rcRectangle[nNumRectangles].fRectangleHeight);
-				fprintf(stderr, "====New rectangle (%d) at %f,%f with size of %f by %f\r\n", nNumRectangles + 1, rcRectangle[nNumRectangles].x0, rcRectangle[nNumRectangles].y0, rcRectangle[nNumRectangles].fRectangleHeight, rcRectangle[nNumRectangles].fRectangleWidth);
-				incrementRectangleCount();
-			}
-			else if (!strncmp("CenterRectangle", szBuffer, 15) )	/* Rectangle given center */
-			{
-				sscanf(&szBuffer[17], "%lf %lf %lf %lf", &rcRectCenter[nNumCtrRectangles].x, &rcRectCenter[nNumCtrRectangles].y, &rcRectCenter[nNumCtrRectangles].fRectangleWidth, &rcRectCenter[nNumCtrRectangles].fRectangleHeight);
-				fprintf(stderr, "-+-New Centered rectangle (%d) at %f,%f with size of %f by %f\r\n", nNumCtrRectangles + 1, rcRectCenter[nNumCtrRectangles].x, rcRectCenter[nNumCtrRectangles].y, rcRectCenter[nNumCtrRectangles].fRectangleHeight, rcRectCenter[nNumCtrRectangles].fRectangleWidth);
-				nNumCtrRectangles++;
-			}
-			else if ( !strncmp("Panel", szBuffer, 5) )     /* Panel dimensions */
-			{
-				sscanf(&szBuffer[7], "%lf %lf", &fPanelWidth, &fPanelHeight);
-				fprintf(stderr, "                 Panel size: %f by %f mm.\n", fPanelWidth, fPanelHeight);
-			}
-			else if ( !strncmp("Background", szBuffer, 10) )     /* Panel dimensions */
-			{
-				sscanf(&szBuffer[12], "%lx", &crBackground);
-				fprintf(stderr, "     Panel background color: 0x%06lx\n", crBackground);
-			}
-			else if ( !strncmp("Text", szBuffer, 4) )
-			{
-				sscanf(&szBuffer[6], "%lf %lf %lf %lx %s", &rcText[nNumStrings].x, &rcText[nNumStrings].y,
-				       &rcText[nNumStrings].size, &rcText[nNumStrings].crColor, rcText[nNumStrings].szFont);
-				fgets(rcText[nNumStrings].szString, 128, f);
-				if ( rcText[nNumStrings].szString[strlen(rcText[nNumStrings].szString) - 1] < '!' )
-					rcText[nNumStrings].szString[strlen(rcText[nNumStrings].szString) - 1] = '\0';
-				if ( rcText[nNumStrings].szString[strlen(rcText[nNumStrings].szString) - 1] < '!' )
-					rcText[nNumStrings].szString[strlen(rcText[nNumStrings].szString) - 1] = '\0';
-				fprintf(stderr, "                      Text : at %f %f size %f face %s\n",
-				        rcText[nNumStrings].x, rcText[nNumStrings].y, rcText[nNumStrings].size,
-				        rcText[nNumStrings].szFont);
-				fprintf(stderr, "                           : [%s]\n", rcText[nNumStrings].szString);
-				nNumStrings++;
-			}
-			else if ( (strlen(szBuffer) > 1) && !nProcessedOK )
-			{
-				if ( szBuffer[strlen(szBuffer) - 1] < '!' )
-					szBuffer[strlen(szBuffer) - 1] = '\0';
-				fprintf(stderr, "***[%s] NOT UNDERSTOOD***\n", szBuffer);
-			}
-		}
+		fprintf(stderr, "*** Error, out of memory for %d entries. ***\n", *pnMax);
+		exit(8);
 	}
+	memset((char *) p + nOld * nSize, 0, (*pnMax - nOld) * nSize);
+	return p;
 }
 
-/* Set default parameters in case no file or missing from file */
-void initParams( void )
+/* Dial parameters not in the script */
+void setDialDefaults( int nFirst, int nLast )
 {
 	int i;
 
-	nNumDials = 0;
-	for ( i = 0; i < MAXDIALS; i++ )
+	for ( i = nFirst; i < nLast; i++ )
 	{
 		rcDial[i].fRadius = 10.0;
 		rcDial[i].fSpan = 270.0;
@@ -449,518 +333,5652 @@ void initParams( void )
 		rcDial[i].fIncrementPerBigTick = 0.01;
 		rcDial[i].fStartAngle = 0.0;
 	}
-	fPanelHeight = 53.975;
-	fPanelWidth = 193.675;
-	nReverse = 0;
-	nNumControls = 0;
-	memset(rcControl, 0, sizeof(rcControl));
-	crBackground = 0xdfefff;
-	nNumStrings = 0;
-	memset(rcText, 0, sizeof(rcText));
 }
 
-/* Dump the PostScript from the buffer */
-void purgeBuffer( void )
+/* Bump up the control number, growing the table if needed */
+void incrementControlCount( void )
 {
-	if ( szBuffer[strlen(szBuffer) - 1] == ' ' )
-		szBuffer[strlen(szBuffer) - 1] = '\0';
-	printf("%s\r\n", szBuffer);
-	memset(szBuffer, 0, sizeof(szBuffer));
+	nNumControls++;
+	rcControl = growTable(rcControl, &nMaxControls, nNumControls, MAXCONTROLS, sizeof(RCCONTROL));
 }
 
-/* Add a string to the buffer */
-void addBuffer( char *p )
+/* Bump up the rectangle numbers */
+
+void incrementRectangleCount( void )
 {
-	if ( strlen(szBuffer) > 72 )
-		purgeBuffer();
-	strcat(szBuffer, p);
+	nNumRectangles++;
+	rcRectangle = growTable(rcRectangle, &nMaxRectangles, nNumRectangles, MAXRECTANGLES, sizeof(RCRECTANGLE));
 }
 
-/* Add a setrgbcolor command to the buffer */
-void addColor( long rgb )
+void incrementCtrRectangleCount( void )
 {
-	double x;
-	char szWork[32];
-
-	x = ( (double) ( (rgb & 0xff0000) >> 16 ) ) / 256.0;
-	sprintf(szWork, "%4.2f ", x);
-	addBuffer(szWork);
-	x = ( (double) ( (rgb & 0xff00) >> 8 ) ) / 256.0;
-	sprintf(szWork, "%4.2f ", x);
-	addBuffer(szWork);
-	x = ( (double) ( (rgb & 0xff) ) ) / 256.0;
-	sprintf(szWork, "%4.2f ", x);
-	addBuffer(szWork);
-	addBuffer("C ");
+	nNumCtrRectangles++;
+	rcRectCenter = growTable(rcRectCenter, &nMaxCtrRectangles, nNumCtrRectangles, MAXRECTANGLES, sizeof(RCRECTCENTER));
 }
 
-/* Add a lineto command to the buffer */
-void addLine( double x, double y )
+/* Bump up the dial number, new dials start with the defaults */
+void incrementDialCount( void )
 {
-	char szWork[32];
-	sprintf(szWork, "%f ", x);
-	addBuffer(szWork);
-	sprintf(szWork, "%f ", y);
-	addBuffer(szWork);
-	addBuffer("L ");
+	int nOld;
+
+	nNumDials++;
+	nOld = nMaxDials;
+	rcDial = growTable(rcDial, &nMaxDials, nNumDials, MAXDIALS, sizeof(RCDIAL));
+	setDialDefaults(nOld, nMaxDials);
 }
 
-/* Add a moveto command to the buffer */
-void addMove( double x, double y )
+void incrementStringCount( void )
 {
-	char szWork[32];
-	sprintf(szWork, "%f ", x);
-	addBuffer(szWork);
-	sprintf(szWork, "%f ", y);
-	addBuffer(szWork);
-	addBuffer("M ");
+	nNumStrings++;
+	rcText = growTable(rcText, &nMaxStrings, nNumStrings, MAXSTRINGS, sizeof(RCTEXT));
 }
 
-/* Calculate the format for display of values */
-void setFormat( int nDialNum, char *szFormat )
+/*
+ * Script variables.  $name anywhere in a line is replaced by the value of
+ * the variable before the line is read.  Var = name value gives a default,
+ * and --vars supplies values for each variant.  A line starting with
+ * If $name is only used when the variable is set to something other than
+ * nothing or 0.  Until the first Var line a $ is an ordinary character, so
+ * older scripts read as they always have.
+ */
+typedef struct
 {
-	int left, right;
+	char szName[32];
+	char *pszDefault;           /* From a Var line, NULL if none */
+	char *pszValue;             /* From --vars, NULL to use the default */
+} VARIABLE;
 
-	strcpy(szFormat, "%lf");
-	if ( rcDial[nDialNum].fStartingIndicator < 9 )
-		left = 1;
-	else if ( rcDial[nDialNum].fStartingIndicator < 90 )
-		left = 2;
-	else if ( rcDial[nDialNum].fStartingIndicator < 900 )
-		left = 3;
-	else if ( rcDial[nDialNum].fStartingIndicator < 9000 )
-		left = 4;
-	else
-		left = 5;
-	if ( rcDial[nDialNum].fIncrementPerBigTick > 0.9 )
-		right = 0;
-	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.09 )
-		right = 1;
-	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.009 )
-		right = 2;
-	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.0009 )
-		right = 3;
-	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.00009 )
-		right = 4;
-	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.000009 )
-		right = 5;
-	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.0000009 )
-		right = 6;
-	else
-		right = 7;
-	sprintf(szFormat, "%%%d.%dlf", left, right);
+VARIABLE *pVariables;
+int nNumVariables, nMaxVariables;
+
+/* A line that used a variable, kept so that a variant can read it again */
+typedef struct
+{
+	int nLine;
+	char *pszText;              /* As written, a Text line is followed by its string */
+	int anBefore[5];            /* Table counts before the line, see countTables() */
+	int nTable;                 /* Table of the entry it set, -1 for none */
+	int nIndex;
+	int nIf;                    /* Started with If */
+	int nPanel;                 /* Sets the panel itself, a change reads the whole script */
+} VARLINE;
+
+VARLINE *pVarLines;
+int nNumVarLines, nMaxVarLines;
+int nRecordVarLines;            /* Keep lines using variables while reading */
+
+#define TABLE_CONTROLS 0
+#define TABLE_RECTANGLES 1
+#define TABLE_CTRRECTANGLES 2
+#define TABLE_DIALS 3
+#define TABLE_STRINGS 4
+
+/* Table counts, in the order the elements are drawn */
+void countTables( int *pnCounts )
+{
+	pnCounts[TABLE_CONTROLS] = nNumControls;
+	pnCounts[TABLE_RECTANGLES] = nNumRectangles;
+	pnCounts[TABLE_CTRRECTANGLES] = nNumCtrRectangles;
+	pnCounts[TABLE_DIALS] = nNumDials;
+	pnCounts[TABLE_STRINGS] = nNumStrings;
 }
 
-/* Add the PostScript header to the output stream */
-void addHeader( void )
-{
-	printf("%%!PS-Adobe-2.0\r\n");
-	printf("%%%%Title: (Panel from file %s)\r\n", szFilename);
-	printf("%%%%Creator: Panel $Revision: 3.4 $\r\n");
-	printf("%%%%Author: (Panel $Revision: 3.4 $)\r\n");
-	printf("%%%%Pages: 1\r\n");
-	printf("%%%%Orientation: Landscape\r\n");
-	printf("%%%%DocumentPaperSizes: %s\r\n", szPagesize);
-	printf("%%%%EndComments\r\n");
-	printf("%%%%BeginProlog\r\n");
-	printf("%%%%BeginProcSet: TextProcs 1.0 0\r\n");
-	printf("/F { findfont exch scalefont setfont } bind def /L { lineto } bind def /C\r\n");
-	printf("{ setrgbcolor } bind def /M { moveto } bind def /S { stroke } bind def /W\r\n");
-	printf("{ setlinewidth } bind def /T { show } bind def /TR { dup stringwidth exch\r\n");
-	printf("neg exch rmoveto show } bind def /TC { dup stringwidth exch 2 div neg\r\n");
-	printf("exch rmoveto show } bind def\r\n");
-	printf("%%%%EndProcSet\r\n");
-	printf("%%%%EndProlog\r\n");
-	printf("%%%%Page: 1 1\r\n");
+void setTableCounts( const int *pnCounts )
+{
+	nNumControls = pnCounts[TABLE_CONTROLS];
+	nNumRectangles = pnCounts[TABLE_RECTANGLES];
+	nNumCtrRectangles = pnCounts[TABLE_CTRRECTANGLES];
+	nNumDials = pnCounts[TABLE_DIALS];
+	nNumStrings = pnCounts[TABLE_STRINGS];
 }
 
-void addControl( double x0, double y0, double diam )
+VARIABLE *findVariable( const char *pszName, size_t nLen )
 {
-	double theta, r, x, y;
 	int i;
 
-	r = diam / 2.0;
-	addBuffer("0.1 W ");
-
-	for ( i = 0; i < 50; i++ )
-	{
-		theta = 6.28 * (double) i / 49.0;
-		x = x0 + r * sin( theta);
-		y = y0 + r * cos( theta );
-		if ( i )
-			addLine(x, y);
-		else
-			addMove(x, y);
-	}
-	/* Fill the circle with white */
-	addColor(0xffffff);
-	addBuffer("closepath fill ");
+	for ( i = 0; i < nNumVariables; i++ )
+		if ( strlen(pVariables[i].szName) == nLen && !strncmp(pVariables[i].szName, pszName, nLen) )
+			return &pVariables[i];
+	return NULL;
+}
 
-	/* Outline it in black */
-	for ( i = 0; i < 100; i++ )
-	{
-		theta = 6.28 * (double) i / 99.0;
-		x = x0 + r * sin( theta);
-		y = y0 + r * cos( theta );
-		if ( i )
-			addLine(x, y);
-		else
-			addMove(x, y);
-	}
-	addColor(0);
-	addBuffer("S ");
+/* Find a variable, adding it with no value if it is new */
+VARIABLE *addVariable( const char *pszName, size_t nLen )
+{
+	VARIABLE *p;
 
-	/* Add the crosshair */
-	addMove(x0 - r, y0);
-	addLine(x0 + r, y0);
-	addBuffer("S ");
-	addMove(x0, y0 - r);
-	addLine(x0, y0 + r);
-	addBuffer("S ");
+	p = findVariable(pszName, nLen);
+	if ( p != NULL )
+		return p;
+	if ( nLen >= sizeof(p->szName) )
+		nLen = sizeof(p->szName) - 1;
+	pVariables = growTable(pVariables, &nMaxVariables, nNumVariables, 16, sizeof(VARIABLE));
+	p = &pVariables[nNumVariables++];
+	memcpy(p->szName, pszName, nLen);
+	p->szName[nLen] = '\0';
+	return p;
 }
 
-void addString( int n )
+/* Whether a Var line has been read, only then is $ special */
+int variablesDeclared( void )
 {
-	char szWork[128];
-	char *p;
+	int i;
 
-	/* Font size */
-	sprintf(szWork, "%6.2f ", rcText[n].size);
-	p = szWork;
-	while ( *p == ' ')
-		p++;
-	addBuffer(p);
-	/* Font name */
-	sprintf(szWork, "/%s ", rcText[n].szFont);
-	addBuffer(szWork);
-	addBuffer("F ");
+	for ( i = 0; i < nNumVariables; i++ )
+		if ( pVariables[i].pszDefault != NULL )
+			return 1;
+	return 0;
+}
 
-	addColor(rcText[n].crColor);
+const char *defaultValue( const VARIABLE *p )
+{
+	return p->pszDefault != NULL ? p->pszDefault : "";
+}
 
-	sprintf(szWork, "%7.2f ", rcText[n].x);
-	p = szWork;
-	while ( *p == ' ')
-		p++;
-	addBuffer(p);
+const char *variableValue( const VARIABLE *p )
+{
+	return p->pszValue != NULL ? p->pszValue : defaultValue(p);
+}
 
-	sprintf(szWork, "%7.2f ", rcText[n].y);
-	p = szWork;
-	while ( *p == ' ')
-		p++;
-	addBuffer(p);
-	addBuffer("M ");
+/* Length of the variable name at p, names do not start with a digit so $5 stays */
+static size_t nameLength( const char *p )
+{
+	size_t n;
 
-	addBuffer("( ");
-	addBuffer(rcText[n].szString);
-	addBuffer(" ) TC ");
+	if ( *p >= '0' && *p <= '9' )
+		return 0;
+	for ( n = 0; p[n] == '_' || (p[n] >= '0' && p[n] <= '9') || (p[n] >= 'a' && p[n] <= 'z') || (p[n] >= 'A' && p[n] <= 'Z'); n++ )
+		;
+	return n;
 }
 
-void addDial( int nDialNum )
+/* Replace each $name in the string, returns the number replaced */
+int expandVariables( char *psz, size_t nSize )
 {
-	int i;
-	char szWork[132];
-	double x, y, x0, y0;
-	double theta, theta0;
-	double fCurrentIndication;
-	int nBig;
-	char szIndicate[128], szFormat[32];
+	char szWork[sizeof(szBuffer)];
+	const char *pValue;
+	VARIABLE *pVar;
+	size_t nOut, nLen, nValue;
+	int nFound;
 	char *p;
-	double fTop, fDelta;
-
-	/* Draw circle */
 
-	fTop = 3.0 * 3.14159268 / 2.0;     /* Angle at top of dial */
+	nFound = 0;
+	nOut = 0;
+	for ( p = psz; *p && nOut < sizeof(szWork) - 1; )
+	{
+		nLen = *p == '$' ? nameLength(p + 1) : 0;
+		if ( nLen == 0 )
+		{
+			szWork[nOut++] = *p++;
+			continue;
+		}
+		pVar = findVariable(p + 1, nLen);
+		if ( pVar == NULL )
+		{
+			fprintf(fLog, "*** Line %d: unknown variable $%.*s ***\n", nLineNumber, (int) nLen, p + 1);
+			pValue = "";
+		}
+		else
+			pValue = variableValue(pVar);
+		nValue = strlen(pValue);
+		if ( nValue > sizeof(szWork) - 1 - nOut )
+			nValue = sizeof(szWork) - 1 - nOut;
+		memcpy(szWork + nOut, pValue, nValue);
+		nOut += nValue;
+		p += nLen + 1;
+		nFound++;
+	}
+	szWork[nOut] = '\0';
+	if ( nFound )
+	{
+		strncpy(psz, szWork, nSize - 1);
+		psz[nSize - 1] = '\0';
+	}
+	return nFound;
+}
+
+/* Whether the variable of an If line is set, and the length of the prefix */
+int testCondition( const char *pszLine, int nDefault, size_t *pnPrefix )
+{
+	VARIABLE *pVar;
+	const char *pValue;
+	size_t nLen;
+
+	nLen = nameLength(pszLine + 4);
+	*pnPrefix = 4 + nLen;
+	while ( pszLine[*pnPrefix] == ' ' )
+		(*pnPrefix)++;
+	pVar = findVariable(pszLine + 4, nLen);
+	if ( pVar == NULL )
+	{
+		fprintf(fLog, "*** Line %d: unknown variable $%.*s ***\n", nLineNumber, (int) nLen, pszLine + 4);
+		return 0;
+	}
+	pValue = nDefault ? defaultValue(pVar) : variableValue(pVar);
+	return *pValue != '\0' && strcmp(pValue, "0");
+}
+
+/*
+ * Reading a line is split in two.  parseLine() works out what a line is
+ * and converts its numbers without touching the tables, so it can run
+ * anywhere; applyLine() then makes the change in order, which is what
+ * depends on the lines before (the current dial, the table counts).
+ */
+#define LINE_NONE 0
+#define LINE_COMMENT 1
+#define LINE_REVERSE 2
+#define LINE_VAR 3
+#define LINE_DIALPARAM 4
+#define LINE_DIAL 5
+#define LINE_CONTROL 6
+#define LINE_RECTANGLE 7
+#define LINE_CTRRECTANGLE 8
+#define LINE_PANEL 9
+#define LINE_BACKGROUND 10
+#define LINE_TEXT 11
+#define LINE_LONG 12            /* Too long for getFile() to read as one line */
+
+typedef struct
+{
+	int nKind;
+	int nFields;                /* Values sscanf() converted */
+	double a[4];
+	long n;                     /* Dial parameter number, or a color */
+	long nValue;                /* Integer or color of a dial parameter */
+	char szFont[32];
+	const char *pLine;          /* As read, for the parallel reader */
+	size_t nLen;
+	int nPartial;               /* Last line of the file, with no newline */
+} LINEREC;
+
+/* Dial parameter lines, they set the most recent dial */
+static const struct
+{
+	const char *pszKeyword;
+	int nMatch;                 /* Characters compared */
+	int nOffset;                /* Where the value starts */
+	char cType;                 /* f double, d int, x color */
+	size_t nField;
+	const char *pszLog;
+} dialParams[] =
+{
+	{ "Radius", 6, 8, 'f', offsetof(RCDIAL, fRadius), "                     Radius: %lf\n" },
+	{ "Span", 4, 6, 'f', offsetof(RCDIAL, fSpan), "                       Span: %lf\n" },
+	{ "NumTicks", 8, 10, 'd', offsetof(RCDIAL, nNumTicks), "       Number of Tick marks: %d\n" },
+	{ "BigPer", 6, 8, 'd', offsetof(RCDIAL, nBigPer), "        Small ticks per big: %d\n" },
+	{ "SizeTicks", 9, 11, 'f', offsetof(RCDIAL, fSizeTicks), "   Size of small tick marks: %lf\n" },
+	{ "SizeBig", 7, 9, 'f', offsetof(RCDIAL, fSizeBig), "     Size of big tick marks: %lf\n" },
+	{ "StartingIndicator", 17, 19, 'f', offsetof(RCDIAL, fStartingIndicator), "         Starting indicator: %lf\n" },
+	{ "IncrementPerBigTick", 19, 21, 'f', offsetof(RCDIAL, fIncrementPerBigTick), "Increment per big tick mark: %lf\n" },
+	{ "SizeFont", 8, 11, 'f', offsetof(RCDIAL, fSizeFont), "            Size of numbers: %lf\n" },
+	{ "ColorCircle", 11, 13, 'x', offsetof(RCDIAL, crCircle), "            Color of circle: 0x%06lx\n" },
+	{ "ColorTickMarks", 14, 16, 'x', offsetof(RCDIAL, crTickMarks), "  Color of small tick marks: 0x%06lx\n" },
+	{ "ColorBigTickMarks", 17, 19, 'x', offsetof(RCDIAL, crBigTickMarks), "    Color of big tick marks: 0x%06lx\n" },
+	{ "ColorText", 9, 11, 'x', offsetof(RCDIAL, crText), "           Color of numbers: 0x%06lx\n" },
+	{ "StartAngle", 4, 12, 'f', offsetof(RCDIAL, fStartAngle), "                Start Angle: %lf\n" },
+};
+
+/* Drop up to two trailing newline or white space characters */
+void trimLine( char *p )
+{
+	size_t n;
+
+	n = strlen(p);
+	if ( n && p[n - 1] < '!' )
+		p[--n] = '\0';
+	if ( n && p[n - 1] < '!' )
+		p[--n] = '\0';
+}
+
+/* Arguments of a line, nothing if the line is too short to have any */
+static const char *lineArgs( const char *psz, size_t nOffset )
+{
+	return strnlen(psz, nOffset) < nOffset ? "" : psz + nOffset;
+}
+
+/* A control hole of a known diameter */
+static void parseControl( const char *psz, size_t nOffset, double fDiam, LINEREC *pRec )
+{
+	pRec->nKind = LINE_CONTROL;
+	pRec->nFields = sscanf(lineArgs(psz, nOffset), "%lf %lf", &pRec->a[0], &pRec->a[1]);
+	pRec->a[2] = fDiam;
+}
+
+/* Work out what a trimmed line is, without changing anything */
+void parseLine( const char *psz, LINEREC *pRec )
+{
+	const char *pArgs;
+	int i, n;
+
+	pRec->nKind = LINE_NONE;
+	pRec->nFields = 0;
+	for ( i = 0; i < (int) (sizeof(dialParams) / sizeof(dialParams[0])); i++ )
+		if ( !strncmp(dialParams[i].pszKeyword, psz, dialParams[i].nMatch) )
+		{
+			pRec->nKind = LINE_DIALPARAM;
+			pRec->n = i;
+			pArgs = lineArgs(psz, dialParams[i].nOffset);
+			if ( dialParams[i].cType == 'f' )
+				pRec->nFields = sscanf(pArgs, "%lf", &pRec->a[0]);
+			else if ( dialParams[i].cType == 'd' )
+			{
+				pRec->nFields = sscanf(pArgs, "%d", &n);
+				pRec->nValue = n;
+			}
+			else
+				pRec->nFields = sscanf(pArgs, "%lx", &pRec->nValue);
+			return;
+		}
+
+	if ( !strncmp("Reverse", psz, 7) )	/* Print in reverse? */
+		pRec->nKind = LINE_REVERSE;
+	else if ( !strncmp("/*", psz, 2) || !strncmp("/**", psz, 3) ) /* Comments */
+		pRec->nKind = LINE_COMMENT;
+	else if ( !strncmp("Var", psz, 3) ) /* Variable default */
+		pRec->nKind = LINE_VAR;
+	else if ( !strncmp("Dial", psz, 4) ) /* Dials */
+	{
+		pRec->nKind = LINE_DIAL;
+		pRec->nFields = sscanf(lineArgs(psz, 6), "%lf %lf", &pRec->a[0], &pRec->a[1]);
+	}
+	else if ( !strncmp("ControlLarge", psz, 12) ) /* Large pots etc. */
+		parseControl(psz, 14, 9.35, pRec);
+	else if ( !strncmp("ControlPhone", psz, 12) ) /* 1/4" phone jack */
+		parseControl(psz, 14, 8.8, pRec);
+	else if ( !strncmp("ControlLED", psz, 10) ) /* 5mm LED holder */
+		parseControl(psz, 12, 6.0, pRec);
+	else if ( !strncmp("ControlSmall", psz, 12) ) /* 3.5 mm phone jack */
+		parseControl(psz, 14, 5.75, pRec);
+	else if ( !strncmp("ControlTiny", psz, 11) ) /* 2.5 mm phone jack */
+		parseControl(psz, 13, 3.8, pRec);
+	else if ( !strncmp("ControlMicro", psz, 12) ) /* 3 mm LED hole */
+		parseControl(psz, 14, 2.6, pRec);
+	else if ( !strncmp("Rectangle", psz, 9) )	/* Rectangle */
+	{
+		pRec->nKind = LINE_RECTANGLE;
+		pRec->nFields = sscanf(lineArgs(psz, 11), "%lf %lf %lf %lf", &pRec->a[0], &pRec->a[1], &pRec->a[2], &pRec->a[3]);
+	}
+	else if ( !strncmp("CenterRectangle", psz, 15) )	/* Rectangle given center */
+	{
+		pRec->nKind = LINE_CTRRECTANGLE;
+		pRec->nFields = sscanf(lineArgs(psz, 17), "%lf %lf %lf %lf", &pRec->a[0], &pRec->a[1], &pRec->a[2], &pRec->a[3]);
+	}
+	else if ( !strncmp("Panel", psz, 5) )     /* Panel dimensions */
+	{
+		pRec->nKind = LINE_PANEL;
+		pRec->nFields = sscanf(lineArgs(psz, 7), "%lf %lf", &pRec->a[0], &pRec->a[1]);
+	}
+	else if ( !strncmp("Background", psz, 10) )     /* Panel background */
+	{
+		pRec->nKind = LINE_BACKGROUND;
+		pRec->nFields = sscanf(lineArgs(psz, 12), "%lx", &pRec->n);
+	}
+	else if ( !strncmp("Text", psz, 4) )
+	{
+		pRec->nKind = LINE_TEXT;
+		pRec->szFont[0] = '\0';
+		pRec->nFields = sscanf(lineArgs(psz, 6), "%lf %lf %lf %lx %31s", &pRec->a[0], &pRec->a[1],
+		                       &pRec->a[2], &pRec->n, pRec->szFont);
+	}
+	if ( pRec->nFields < 0 )
+		pRec->nFields = 0;
+}
+
+/*
+ * Make the change a line describes, nLine is its line number.  For Text
+ * the string is already in the next rcText[] entry.  Only the values the
+ * line actually gave are set.
+ */
+void applyLine( const LINEREC *pRec, char *pszLine, int nLine )
+{
+	VARIABLE *pVar;
+	RCDIAL *pDial;
+	char *p;
+
+	switch ( pRec->nKind )
+	{
+	case LINE_DIALPARAM:
+		if ( nNumDials > 0 )
+		{
+			pDial = &rcDial[nNumDials - 1];
+			p = (char *) pDial + dialParams[pRec->n].nField;
+			if ( dialParams[pRec->n].cType == 'f' )
+			{
+				if ( pRec->nFields > 0 )
+					*(double *) p = pRec->a[0];
+				fprintf(fLog, dialParams[pRec->n].pszLog, *(double *) p);
+			}
+			else if ( dialParams[pRec->n].cType == 'd' )
+			{
+				if ( pRec->nFields > 0 )
+					*(int *) p = (int) pRec->nValue;
+				fprintf(fLog, dialParams[pRec->n].pszLog, *(int *) p);
+			}
+			else
+			{
+				if ( pRec->nFields > 0 )
+					*(COLORREF *) p = pRec->nValue;
+				fprintf(fLog, dialParams[pRec->n].pszLog, *(COLORREF *) p);
+			}
+			return;
+		}
+		break;
+
+	case LINE_REVERSE:
+		nReverse = 1;
+		fprintf(fLog, "                    Reverse: TRUE\n");
+		return;
+
+	case LINE_COMMENT:
+		return;
+
+	case LINE_VAR:
+		p = (char *) lineArgs(pszLine, 6);
+		if ( *p == '$' )
+			p++;
+		pVar = addVariable(p, nameLength(p));
+		if ( pVar->pszDefault != NULL )
+		{
+			/* Variants compare against the one default, so it is given once */
+			fprintf(fLog, "*** Line %d: variable $%s is already declared, line ignored ***\n", nLineNumber, pVar->szName);
+			return;
+		}
+		p += nameLength(p);
+		while ( *p == ' ' )
+			p++;
+		pVar->pszDefault = strdup(p);
+		fprintf(fLog, "                   Variable: $%s = [%s]\n", pVar->szName, p);
+		return;
+
+	case LINE_DIAL:
+		if ( pRec->nFields > 0 )
+			rcDial[nNumDials].x0 = pRec->a[0];
+		if ( pRec->nFields > 1 )
+			rcDial[nNumDials].y0 = pRec->a[1];
+		fprintf(fLog, "===New dial (%d) at %f,%f\r\n", nNumDials + 1, rcDial[nNumDials].x0, rcDial[nNumDials].y0);
+		rcDial[nNumDials].nLine = nLine;
+		incrementDialCount();
+		return;
+
+	case LINE_CONTROL:
+		if ( pRec->nFields > 0 )
+			rcControl[nNumControls].x = pRec->a[0];
+		if ( pRec->nFields > 1 )
+			rcControl[nNumControls].y = pRec->a[1];
+		rcControl[nNumControls].diam = pRec->a[2];
+		rcControl[nNumControls].nLine = nLine;
+		incrementControlCount();
+		return;
+
+	case LINE_RECTANGLE:
+		if ( pRec->nFields > 0 )
+			rcRectangle[nNumRectangles].x0 = pRec->a[0];
+		if ( pRec->nFields > 1 )
+			rcRectangle[nNumRectangles].y0 = pRec->a[1];
+		if ( pRec->nFields > 2 )
+			rcRectangle[nNumRectangles].fRectangleWidth = pRec->a[2];
+		if ( pRec->nFields > 3 )
+			rcRectangle[nNumRectangles].fRectangleHeight = pRec->a[3];
+		fprintf(fLog, "====New rectangle (%d) at %f,%f with size of %f by %f\r\n", nNumRectangles + 1, rcRectangle[nNumRectangles].x0, rcRectangle[nNumRectangles].y0, rcRectangle[nNumRectangles].fRectangleHeight, rcRectangle[nNumRectangles].fRectangleWidth);
+		rcRectangle[nNumRectangles].nLine = nLine;
+		incrementRectangleCount();
+		return;
+
+	case LINE_CTRRECTANGLE:
+		if ( pRec->nFields > 0 )
+			rcRectCenter[nNumCtrRectangles].x = pRec->a[0];
+		if ( pRec->nFields > 1 )
+			rcRectCenter[nNumCtrRectangles].y = pRec->a[1];
+		if ( pRec->nFields > 2 )
+			rcRectCenter[nNumCtrRectangles].fRectangleWidth = pRec->a[2];
+		if ( pRec->nFields > 3 )
+			rcRectCenter[nNumCtrRectangles].fRectangleHeight = pRec->a[3];
+		fprintf(fLog, "-+-New Centered rectangle (%d) at %f,%f with size of %f by %f\r\n", nNumCtrRectangles + 1, rcRectCenter[nNumCtrRectangles].x, rcRectCenter[nNumCtrRectangles].y, rcRectCenter[nNumCtrRectangles].fRectangleHeight, rcRectCenter[nNumCtrRectangles].fRectangleWidth);
+		rcRectCenter[nNumCtrRectangles].nLine = nLine;
+		incrementCtrRectangleCount();
+		return;
+
+	case LINE_PANEL:
+		if ( pRec->nFields > 0 )
+			fPanelWidth = pRec->a[0];
+		if ( pRec->nFields > 1 )
+			fPanelHeight = pRec->a[1];
+		fprintf(fLog, "                 Panel size: %f by %f mm.\n", fPanelWidth, fPanelHeight);
+		return;
+
+	case LINE_BACKGROUND:
+		if ( pRec->nFields > 0 )
+			crBackground = pRec->n;
+		fprintf(fLog, "     Panel background color: 0x%06lx\n", crBackground);
+		return;
+
+	case LINE_TEXT:
+		if ( pRec->nFields > 0 )
+			rcText[nNumStrings].x = pRec->a[0];
+		if ( pRec->nFields > 1 )
+			rcText[nNumStrings].y = pRec->a[1];
+		if ( pRec->nFields > 2 )
+			rcText[nNumStrings].size = pRec->a[2];
+		if ( pRec->nFields > 3 )
+			rcText[nNumStrings].crColor = pRec->n;
+		if ( pRec->nFields > 4 )
+			strcpy(rcText[nNumStrings].szFont, pRec->szFont);
+		rcText[nNumStrings].nLine = nLine;
+		fprintf(fLog, "                      Text : at %f %f size %f face %s\n",
+		        rcText[nNumStrings].x, rcText[nNumStrings].y, rcText[nNumStrings].size,
+		        rcText[nNumStrings].szFont);
+		fprintf(fLog, "                           : [%s]\n", rcText[nNumStrings].szString);
+		incrementStringCount();
+		return;
+	}
+
+	if ( strlen(pszLine) > 1 )
+	{
+		if ( pszLine[strlen(pszLine) - 1] < '!' )
+			pszLine[strlen(pszLine) - 1] = '\0';
+		fprintf(fLog, "***[%s] NOT UNDERSTOOD***\n", pszLine);
+	}
+}
+
+/* Keep a line that used a variable, nKind is what it turned out to be */
+void recordVarLine( int nLine, const char *pszText, const char *pszString, const int *pnBefore, int nIf, int nKind )
+{
+	VARLINE *p;
+	int anAfter[5];
+	int i;
+
+	pVarLines = growTable(pVarLines, &nMaxVarLines, nNumVarLines, 16, sizeof(VARLINE));
+	p = &pVarLines[nNumVarLines++];
+	p->nLine = nLine;
+	p->pszText = malloc(strlen(pszText) + (pszString != NULL ? strlen(pszString) : 0) + 3);
+	if ( p->pszText == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	sprintf(p->pszText, "%s\n%s%s", pszText, pszString != NULL ? pszString : "", pszString != NULL ? "\n" : "");
+	memcpy(p->anBefore, pnBefore, sizeof(p->anBefore));
+	p->nIf = nIf;
+	p->nPanel = nKind == LINE_PANEL || nKind == LINE_BACKGROUND || nKind == LINE_REVERSE;
+
+	/* A new entry, a parameter of the current dial, or neither */
+	countTables(anAfter);
+	p->nTable = -1;
+	for ( i = 0; i < 5; i++ )
+		if ( anAfter[i] != pnBefore[i] )
+		{
+			p->nTable = i;
+			p->nIndex = pnBefore[i];
+		}
+	if ( p->nTable < 0 && nKind == LINE_DIALPARAM && pnBefore[TABLE_DIALS] > 0 )
+	{
+		p->nTable = TABLE_DIALS;
+		p->nIndex = pnBefore[TABLE_DIALS] - 1;
+	}
+}
+
+/* Read the input file */
+void getFile( FILE *f )
+{
+	LINEREC rec;
+	int nVars, nIf, nFirstLine;
+	int anBefore[5];
+	char szTemplate[sizeof(szBuffer)];
+	char szStringTemplate[128];
+	char *pszString;
+	size_t nPrefix;
+
+	while ( !feof(f) )
+	{
+		fgets(szBuffer, sizeof(szBuffer), f);
+		if ( !feof(f) )
+		{
+			nLineNumber++;
+			trimLine(szBuffer);
+
+			/* Substitute variables, keeping the line as written */
+			nFirstLine = nLineNumber;
+			nVars = 0;
+			nIf = 0;
+			pszString = NULL;
+			if ( nRecordVarLines )
+			{
+				strcpy(szTemplate, szBuffer);
+				countTables(anBefore);
+			}
+			if ( !strncmp("If $", szBuffer, 4) && variablesDeclared() )
+			{
+				nIf = 1;
+				if ( !testCondition(szBuffer, 0, &nPrefix) )
+				{
+					/* Skip the line, and the string that goes with a Text */
+					if ( !strncmp("Text", szBuffer + nPrefix, 4) && fgets(szStringTemplate, sizeof(szStringTemplate), f) != NULL )
+					{
+						nLineNumber++;
+						szStringTemplate[strcspn(szStringTemplate, "\r\n")] = '\0';
+						pszString = szStringTemplate;
+					}
+					if ( nRecordVarLines )
+						recordVarLine(nFirstLine, szTemplate, pszString, anBefore, 1, LINE_NONE);
+					continue;
+				}
+				memmove(szBuffer, szBuffer + nPrefix, strlen(szBuffer + nPrefix) + 1);
+			}
+			if ( strncmp("Var", szBuffer, 3) && strchr(szBuffer, '$') != NULL && variablesDeclared() )
+				nVars = expandVariables(szBuffer, sizeof(szBuffer));
+
+			parseLine(szBuffer, &rec);
+			if ( rec.nKind == LINE_TEXT )
+			{
+				/* The string is the next line */
+				if ( fgets(rcText[nNumStrings].szString, 128, f) == NULL )
+					rcText[nNumStrings].szString[0] = '\0';
+				nLineNumber++;
+				trimLine(rcText[nNumStrings].szString);
+				strcpy(szStringTemplate, rcText[nNumStrings].szString);
+				pszString = szStringTemplate;
+				if ( strchr(rcText[nNumStrings].szString, '$') != NULL && variablesDeclared() )
+					nVars += expandVariables(rcText[nNumStrings].szString, sizeof(rcText[nNumStrings].szString));
+			}
+			applyLine(&rec, szBuffer, nFirstLine);
+
+			if ( nRecordVarLines && (nVars || nIf) )
+				recordVarLine(nFirstLine, szTemplate, pszString, anBefore, nIf, rec.nKind);
+		}
+	}
+}
+
+/*
+ * Parallel reading of large scripts.  The mapped file is cut at line
+ * boundaries and each piece goes through parseLine() on a thread of its
+ * own, taking every line as a command.  Only a pass in order knows which
+ * lines are really the strings of the Text lines before them, and which
+ * dial a dial parameter belongs to, so a short sequential pass then pairs
+ * each Text with the next line and applies everything through applyLine()
+ * in file order.  The tables, line numbers and log come out exactly as
+ * getFile() makes them.
+ */
+#define MINPARALLELREAD (256 * 1024)    /* Smaller scripts are read serially */
+
+typedef struct
+{
+	const char *pStart, *pEnd;
+	LINEREC *pRecs;
+	int nRecs;
+	pthread_t thread;
+	int nThread;
+} READCHUNK;
+
+static void *readChunk( void *pArg )
+{
+	READCHUNK *pChunk = pArg;
+	char szLine[sizeof(szBuffer)];
+	const char *p, *q;
+	LINEREC *pRec;
+	int nLines;
+
+	for ( nLines = 1, p = pChunk->pStart; (p = memchr(p, '\n', pChunk->pEnd - p)) != NULL; p++ )
+		nLines++;
+	pChunk->pRecs = malloc(nLines * sizeof(LINEREC));
+	if ( pChunk->pRecs == NULL )
+		return NULL;
+	for ( p = pChunk->pStart; p < pChunk->pEnd; p = q + 1 )
+	{
+		q = memchr(p, '\n', pChunk->pEnd - p);
+		pRec = &pChunk->pRecs[pChunk->nRecs++];
+		pRec->pLine = p;
+		pRec->nPartial = q == NULL;
+		if ( q == NULL )
+			q = pChunk->pEnd;
+		pRec->nLen = q - p;
+		if ( pRec->nLen + 2 > sizeof(szLine) )
+		{
+			pRec->nKind = LINE_LONG;
+			continue;
+		}
+		memcpy(szLine, p, pRec->nLen);
+		szLine[pRec->nLen] = '\n';
+		szLine[pRec->nLen + 1] = '\0';
+		trimLine(szLine);
+		parseLine(szLine, pRec);
+	}
+	return NULL;
+}
+
+/* A line as fgets() would have read it into p, trimmed */
+static void copyLine( char *p, const LINEREC *pRec )
+{
+	memcpy(p, pRec->pLine, pRec->nLen);
+	if ( pRec->nPartial )
+		p[pRec->nLen] = '\0';
+	else
+		strcpy(p + pRec->nLen, "\n");
+	trimLine(p);
+}
+
+/* Apply the parsed pieces in order, 0 if getFile() has to read it instead */
+static int applyChunks( READCHUNK *pChunks, int nChunks )
+{
+	const LINEREC *pRec, *pText;
+	int i, j, nPending, nTextLine;
+
+	/* Lines getFile() would split can't be read ahead, so check first */
+	nPending = 0;
+	for ( i = 0; i < nChunks; i++ )
+	{
+		if ( pChunks[i].pRecs == NULL )
+			return 0;
+		for ( j = 0; j < pChunks[i].nRecs; j++ )
+		{
+			pRec = &pChunks[i].pRecs[j];
+			if ( nPending )
+			{
+				if ( pRec->nLen + 1 >= sizeof(rcText[0].szString) )
+					return 0;
+				nPending = 0;
+			}
+			else if ( pRec->nKind == LINE_LONG )
+				return 0;
+			else
+				nPending = pRec->nKind == LINE_TEXT && !pRec->nPartial;
+		}
+	}
+
+	pText = NULL;
+	nTextLine = 0;
+	for ( i = 0; i < nChunks; i++ )
+		for ( j = 0; j < pChunks[i].nRecs; j++ )
+		{
+			pRec = &pChunks[i].pRecs[j];
+			if ( pText != NULL )
+			{
+				/* This line is the string of the Text before it */
+				copyLine(rcText[nNumStrings].szString, pRec);
+				nLineNumber++;
+				applyLine(pText, szBuffer, nTextLine);
+				pText = NULL;
+				continue;
+			}
+			if ( pRec->nPartial )
+				continue;       /* getFile() stops at a last line with no newline */
+			nLineNumber++;
+			if ( pRec->nKind == LINE_TEXT )
+			{
+				pText = pRec;
+				nTextLine = nLineNumber;
+				continue;
+			}
+			copyLine(szBuffer, pRec);
+			applyLine(pRec, szBuffer, nLineNumber);
+		}
+	if ( pText != NULL )
+	{
+		/* A Text on the last line has no string */
+		rcText[nNumStrings].szString[0] = '\0';
+		nLineNumber++;
+		applyLine(pText, szBuffer, nTextLine);
+	}
+	return 1;
+}
+
+/*
+ * Read a large script on nThreads threads.  Returns 0 without reading
+ * anything when getFile() should read it instead: small files, pipes,
+ * scripts with variables, which change as the file is read, and lines the
+ * serial reader would split.
+ */
+int getFileParallel( FILE *f, int nThreads )
+{
+	READCHUNK *pChunks;
+	struct stat st;
+	const char *pData, *p, *q;
+	size_t nSize;
+	int i, nDone;
+
+	if ( nThreads < 2 || nRecordVarLines || fstat(fileno(f), &st) || !S_ISREG(st.st_mode)
+	     || st.st_size < MINPARALLELREAD || ftell(f) != 0 )
+		return 0;
+	nSize = st.st_size;
+	pData = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if ( pData == MAP_FAILED )
+		return 0;
+	if ( memchr(pData, '$', nSize) != NULL || memchr(pData, '\0', nSize) != NULL
+	     || (pChunks = calloc(nThreads, sizeof(READCHUNK))) == NULL )
+	{
+		munmap((void *) pData, nSize);
+		return 0;
+	}
+
+	/* Pieces of about the same size, each ending after a newline */
+	p = pData;
+	for ( i = 0; i < nThreads; i++ )
+	{
+		pChunks[i].pStart = p;
+		q = pData + (i + 1) * (nSize / nThreads);
+		if ( i == nThreads - 1 )
+			p = pData + nSize;
+		else if ( q >= p )
+		{
+			q = memchr(q, '\n', pData + nSize - q);
+			p = q == NULL ? pData + nSize : q + 1;
+		}
+		pChunks[i].pEnd = p;
+	}
+
+	for ( i = 1; i < nThreads; i++ )
+		pChunks[i].nThread = !pthread_create(&pChunks[i].thread, NULL, readChunk, &pChunks[i]);
+	for ( i = 0; i < nThreads; i++ )
+		if ( !pChunks[i].nThread )
+			readChunk(&pChunks[i]);
+	for ( i = 1; i < nThreads; i++ )
+		if ( pChunks[i].nThread )
+			pthread_join(pChunks[i].thread, NULL);
+
+	nDone = applyChunks(pChunks, nThreads);
+
+	for ( i = 0; i < nThreads; i++ )
+		free(pChunks[i].pRecs);
+	free(pChunks);
+	munmap((void *) pData, nSize);
+	return nDone;
+}
+
+/* Set default parameters in case no file or missing from file */
+void initParams( void )
+{
+	int i;
+
+	rcControl = growTable(rcControl, &nMaxControls, 0, MAXCONTROLS, sizeof(RCCONTROL));
+	rcDial = growTable(rcDial, &nMaxDials, 0, MAXDIALS, sizeof(RCDIAL));
+	rcRectangle = growTable(rcRectangle, &nMaxRectangles, 0, MAXRECTANGLES, sizeof(RCRECTANGLE));
+	rcRectCenter = growTable(rcRectCenter, &nMaxCtrRectangles, 0, MAXRECTANGLES, sizeof(RCRECTCENTER));
+	rcText = growTable(rcText, &nMaxStrings, 0, MAXSTRINGS, sizeof(RCTEXT));
+
+	nNumDials = 0;
+	memset(rcDial, 0, nMaxDials * sizeof(RCDIAL));
+	setDialDefaults(0, nMaxDials);
+	fPanelHeight = 53.975;
+	fPanelWidth = 193.675;
+	nReverse = 0;
+	nNumControls = 0;
+	memset(rcControl, 0, nMaxControls * sizeof(RCCONTROL));
+	crBackground = 0xdfefff;
+	nNumStrings = 0;
+	memset(rcText, 0, nMaxStrings * sizeof(RCTEXT));
+	nNumRectangles = 0;
+	nNumCtrRectangles = 0;
+	szFilename[0] = '\0';
+	nLineNumber = 0;
+	nGeometryBuilt = 0;
+	/* Defaults come from the script, values given for a variant stay */
+	for ( i = 0; i < nNumVariables; i++ )
+	{
+		free(pVariables[i].pszDefault);
+		pVariables[i].pszDefault = NULL;
+	}
+}
+
+/* Dump the PostScript from the buffer */
+void purgeBuffer( void )
+{
+	if ( nBufferLen && szBuffer[nBufferLen - 1] == ' ' )
+		szBuffer[--nBufferLen] = '\0';
+	nBytesOut += fprintf(fOut, "%s\r\n", szBuffer);
+	szBuffer[0] = '\0';
+	nBufferLen = 0;
+}
+
+/* Add a string to the buffer */
+void addBuffer( char *p )
+{
+	size_t n;
+
+	if ( pFragment != NULL )
+	{
+		n = strlen(p) + 1;
+		if ( pFragment->nText + n > pFragment->nSize )
+		{
+			pFragment->nSize = 2 * (pFragment->nText + n) + 256;
+			pFragment->pText = realloc(pFragment->pText, pFragment->nSize);
+			if ( pFragment->pText == NULL )
+			{
+				fprintf(stderr, "*** Error, out of memory. ***\n");
+				exit(8);
+			}
+		}
+		memcpy(pFragment->pText + pFragment->nText, p, n);
+		pFragment->nText += n;
+		return;
+	}
+	if ( nBufferLen > 72 )
+		purgeBuffer();
+	n = strlen(p);
+	memcpy(szBuffer + nBufferLen, p, n + 1);
+	nBufferLen += n;
+}
+
+/* Add a setrgbcolor command to the buffer */
+void addColor( long rgb )
+{
+	double x;
+	char szWork[32];
+
+	x = ( (double) ( (rgb & 0xff0000) >> 16 ) ) / 256.0;
+	sprintf(szWork, "%4.2f ", x);
+	addBuffer(szWork);
+	x = ( (double) ( (rgb & 0xff00) >> 8 ) ) / 256.0;
+	sprintf(szWork, "%4.2f ", x);
+	addBuffer(szWork);
+	x = ( (double) ( (rgb & 0xff) ) ) / 256.0;
+	sprintf(szWork, "%4.2f ", x);
+	addBuffer(szWork);
+	addBuffer("C ");
+}
+
+/*
+ * Compact coordinates.  With --compact, coordinates are rounded to a
+ * decimal grid no coarser than the device resolution and written without
+ * trailing zeros.  A lineto is written relative to the current point when
+ * that is shorter.  Positions are kept as whole grid units, so relative
+ * steps never drift.  Moves stay absolute because every path starts after
+ * a stroke or fill, when PostScript has no current point.
+ */
+void setCompact( void )
+{
+	double fDot;
+
+	fDot = 25.4 / fResolution;
+	nCompactDigits = (int) ceil(-log10(fDot) - 1e-9);
+	if ( nCompactDigits < 0 )
+		nCompactDigits = 0;
+	if ( nCompactDigits > 6 )
+		nCompactDigits = 6;
+	fCompactScale = pow(10.0, nCompactDigits);
+}
+
+/* Write n grid units as the shortest decimal, followed by a space */
+static int formatCompact( char *p, long long n )
+{
+	long long nUnit, nWhole, nFrac;
+	char szFrac[16];
+	char *q;
+	int i;
+
+	q = p;
+	if ( n < 0 )
+	{
+		*q++ = '-';
+		n = -n;
+	}
+	nUnit = llround(fCompactScale);
+	nWhole = n / nUnit;
+	nFrac = n % nUnit;
+	if ( nWhole || !nFrac )         /* PostScript takes .5 for 0.5 */
+		q += sprintf(q, "%lld", nWhole);
+	if ( nFrac )
+	{
+		sprintf(szFrac, "%0*lld", nCompactDigits, nFrac);
+		for ( i = nCompactDigits - 1; szFrac[i] == '0'; i-- )
+			szFrac[i] = '\0';
+		q += sprintf(q, ".%s", szFrac);
+	}
+	*q++ = ' ';
+	*q = '\0';
+	return (int) (q - p);
+}
+
+/* Length of a coordinate pair and operator at full precision */
+static int fullLength( double x, double y )
+{
+	char szWork[64];
+
+	return sprintf(szWork, "%f %f L ", x, y);
+}
+
+/* Add a lineto command to the buffer */
+void addLine( double x, double y )
+{
+	char szWork[32], szY[32], szDX[32], szDY[32];
+	long long nX, nY;
+	int nAbs, nRel;
+
+	if ( nCompact )
+	{
+		nX = llround(x * fCompactScale);
+		nY = llround(y * fCompactScale);
+		nAbs = formatCompact(szWork, nX) + formatCompact(szY, nY);
+		nRel = formatCompact(szDX, nX - nCurX) + formatCompact(szDY, nY - nCurY);
+		if ( nRel < nAbs )
+		{
+			addBuffer(szDX);
+			addBuffer(szDY);
+			addBuffer("l ");
+			nBytesSaved += fullLength(x, y) - nRel - 2;
+		}
+		else
+		{
+			addBuffer(szWork);
+			addBuffer(szY);
+			addBuffer("L ");
+			nBytesSaved += fullLength(x, y) - nAbs - 2;
+		}
+		nCurX = nX;
+		nCurY = nY;
+		return;
+	}
+	sprintf(szWork, "%f ", x);
+	addBuffer(szWork);
+	sprintf(szWork, "%f ", y);
+	addBuffer(szWork);
+	addBuffer("L ");
+}
+
+/* Add a moveto command to the buffer */
+void addMove( double x, double y )
+{
+	char szWork[32];
+	int n;
+
+	if ( nCompact )
+	{
+		nCurX = llround(x * fCompactScale);
+		nCurY = llround(y * fCompactScale);
+		n = formatCompact(szWork, nCurX);
+		addBuffer(szWork);
+		n += formatCompact(szWork, nCurY);
+		addBuffer(szWork);
+		addBuffer("M ");
+		nBytesSaved += fullLength(x, y) - n - 2;
+		return;
+	}
+	sprintf(szWork, "%f ", x);
+	addBuffer(szWork);
+	sprintf(szWork, "%f ", y);
+	addBuffer(szWork);
+	addBuffer("M ");
+}
+
+/* Calculate the format for display of values */
+void setFormat( int nDialNum, char *szFormat )
+{
+	int left, right;
+
+	strcpy(szFormat, "%lf");
+	if ( rcDial[nDialNum].fStartingIndicator < 9 )
+		left = 1;
+	else if ( rcDial[nDialNum].fStartingIndicator < 90 )
+		left = 2;
+	else if ( rcDial[nDialNum].fStartingIndicator < 900 )
+		left = 3;
+	else if ( rcDial[nDialNum].fStartingIndicator < 9000 )
+		left = 4;
+	else
+		left = 5;
+	if ( rcDial[nDialNum].fIncrementPerBigTick > 0.9 )
+		right = 0;
+	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.09 )
+		right = 1;
+	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.009 )
+		right = 2;
+	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.0009 )
+		right = 3;
+	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.00009 )
+		right = 4;
+	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.000009 )
+		right = 5;
+	else if ( rcDial[nDialNum].fIncrementPerBigTick > 0.0000009 )
+		right = 6;
+	else
+		right = 7;
+	sprintf(szFormat, "%%%d.%dlf", left, right);
+}
+
+/* Add the PostScript header to the output stream */
+void addHeader( int nPages )
+{
+	nBytesOut += fprintf(fOut, "%%!PS-Adobe-2.0\r\n");
+	nBytesOut += fprintf(fOut, "%%%%Title: (Panel from file %s)\r\n", szFilename);
+	nBytesOut += fprintf(fOut, "%%%%Creator: Panel $Revision: 3.4 $\r\n");
+	nBytesOut += fprintf(fOut, "%%%%Author: (Panel $Revision: 3.4 $)\r\n");
+	nBytesOut += fprintf(fOut, "%%%%Pages: %d\r\n", nPages);
+	nBytesOut += fprintf(fOut, "%%%%Orientation: Landscape\r\n");
+	nBytesOut += fprintf(fOut, "%%%%DocumentPaperSizes: %s\r\n", szPagesize);
+	nBytesOut += fprintf(fOut, "%%%%EndComments\r\n");
+	nBytesOut += fprintf(fOut, "%%%%BeginProlog\r\n");
+	nBytesOut += fprintf(fOut, "%%%%BeginProcSet: TextProcs 1.0 0\r\n");
+	nBytesOut += fprintf(fOut, "/F { findfont exch scalefont setfont } bind def /L { lineto } bind def /C\r\n");
+	nBytesOut += fprintf(fOut, "{ setrgbcolor } bind def /M { moveto } bind def /S { stroke } bind def /W\r\n");
+	nBytesOut += fprintf(fOut, "{ setlinewidth } bind def /T { show } bind def /TR { dup stringwidth exch\r\n");
+	nBytesOut += fprintf(fOut, "neg exch rmoveto show } bind def /TC { dup stringwidth exch 2 div neg\r\n");
+	nBytesOut += fprintf(fOut, "exch rmoveto show } bind def\r\n");
+	if ( nCompact )
+		nBytesOut += fprintf(fOut, "/l { rlineto } bind def\r\n");
+	nBytesOut += fprintf(fOut, "%%%%EndProcSet\r\n");
+	nBytesOut += fprintf(fOut, "%%%%EndProlog\r\n");
+}
+
+/*
+ * Shared geometry.  The points of the control circles and of each dial's
+ * arc, ticks and labels are worked out once by buildGeometry() and then
+ * drawn by every output format from the same numbers.
+ *
+ * Curves have fixed point counts unless --tolerance is given, then each
+ * one gets as many points as its radius needs, see arcSegments().
+ */
+#define FILLPOINTS 50           /* Points in the white fill of a control */
+#define OUTLINEPOINTS 100       /* Points in the outline of a control */
+#define ARCPOINTS 1000          /* Points in the arc of a dial */
+#define CONTROLLINE 0.1         /* Width of a control outline, mm */
+
+#define ALIGN_LEFT 0            /* Text starts at the point, T */
+#define ALIGN_CENTER 1          /* Text centered on the point, TC */
+#define ALIGN_RIGHT 2           /* Text ends at the point, TR */
+
+typedef struct
+{
+	double x0, y0;              /* On the circle */
+	double x1, y1;              /* Outer end */
+	int nBig;
+	int nAlign;                 /* Where a big tick label goes */
+	char szLabel[64];
+} TICK;
+
+typedef struct
+{
+	int nArc;
+	double *pArc;               /* x, y pairs */
+	int nTicks;
+	TICK *pTicks;
+} DIALGEOM;
+
+/* sin and cos of the angles around a control, from the top clockwise */
+double fFillCircle[FILLPOINTS][2];
+double fOutlineCircle[OUTLINEPOINTS][2];
+
+/* The circle points for one control size */
+typedef struct
+{
+	double fDiam;
+	int nFill, nOutline;
+	double *pFill, *pOutline;   /* sin, cos pairs */
+} CIRCLEGEOM;
+
+CIRCLEGEOM circleFixed = { 0.0, FILLPOINTS, OUTLINEPOINTS, &fFillCircle[0][0], &fOutlineCircle[0][0] };
+CIRCLEGEOM *pCircleGeom;
+int nNumCircleGeom;
+int nMaxCircleGeom;
+double fTolerance;              /* Largest chord error in mm, 0 for fixed counts */
+
+DIALGEOM *pDialGeom;
+int nMaxDialGeom;
+
+/*
+ * Segments for fSweep degrees of a curve of radius r, so that no chord
+ * is further than fError from the curve.  Errors finer than half a device
+ * dot can't be seen and are not asked for.  Every curve drawn as a
+ * polyline gets its point count from here.
+ */
+int arcSegments( double r, double fSweep, double fError )
+{
+	double fStep;
+	int n, nMin;
+
+	if ( fError < 0.5 * 25.4 / fResolution )
+		fError = 0.5 * 25.4 / fResolution;
+	fSweep = fabs(fSweep);
+	nMin = (int) ceil(fSweep / 45.0);   /* Even a dot stays round */
+	if ( nMin < 1 )
+		nMin = 1;
+	if ( r <= fError / 2.0 )
+		return nMin;
+	fStep = 2.0 * acos(1.0 - fError / r) * 180.0 / 3.14159268;   /* Degrees per chord */
+	n = (int) ceil(fSweep / fStep);
+	return n < nMin ? nMin : n;
+}
+
+/* sin and cos of n points around a circle from the top, the last on the first */
+static double *circlePoints( double *p, int n )
+{
+	double theta;
+	int i;
+
+	p = realloc(p, 2 * n * sizeof(double));
+	if ( p == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	for ( i = 0; i < n; i++ )
+	{
+		theta = 2.0 * 3.14159268 * (double) i / (n - 1);
+		p[2 * i] = sin( theta );
+		p[2 * i + 1] = cos( theta );
+	}
+	return p;
+}
+
+/* Points for a control of this size, built by buildGeometry() */
+const CIRCLEGEOM *controlCircle( double diam )
+{
+	int i;
+
+	for ( i = 0; i < nNumCircleGeom; i++ )
+		if ( pCircleGeom[i].fDiam == diam )
+			return &pCircleGeom[i];
+	return &circleFixed;
+}
+
+/* Work out the arc, ticks and labels of a dial */
+void buildDial( int nDialNum, DIALGEOM *pGeom )
+{
+	RCDIAL *pDial;
+	TICK *pTick;
+	double x0, y0, theta, theta0, nn;
+	double fTop, fDelta;
+	double fCurrentIndication;
+	char szFormat[32];
+	int i, nBig;
+
+	pDial = &rcDial[nDialNum];
+	fTop = 3.0 * 3.14159268 / 2.0;     /* Angle at top of dial */
 	fDelta = 3.14159268 / 18.0;        /* Range of angles to center number */
+	x0 = pDial->x0;
+	y0 = pDial->y0;
+	theta0 = 90.0 + (360.0 - pDial->fSpan) / 2.0 + pDial->fStartAngle; /* Starting angle */
+
+	pGeom->nArc = fTolerance > 0.0 ? arcSegments(pDial->fRadius, pDial->fSpan, fTolerance) + 1 : ARCPOINTS;
+	pGeom->pArc = realloc(pGeom->pArc, 2 * pGeom->nArc * sizeof(double));
+	pGeom->nTicks = pDial->nNumTicks > 0 ? pDial->nNumTicks : 0;
+	pGeom->pTicks = realloc(pGeom->pTicks, (pGeom->nTicks + 1) * sizeof(TICK));
+	if ( pGeom->pArc == NULL || pGeom->pTicks == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+
+	for ( i = 0; i < pGeom->nArc; i++ )     /* Normally 1000 segments */
+	{
+		theta = 3.14159268 * (theta0 + ((double) i) * pDial->fSpan / (pGeom->nArc - 1)) / 180.0;
+		pGeom->pArc[2 * i] = x0 + pDial->fRadius * cos( theta );
+		pGeom->pArc[2 * i + 1] = y0 - pDial->fRadius * sin( theta );
+	}
+
+	setFormat( nDialNum, szFormat );             /* Calculate format for numbers */
+	nBig = 0;
+	nn = pDial->nNumTicks - 1;
+	for ( i = 0; i < pGeom->nTicks; i++ )
+	{
+		pTick = &pGeom->pTicks[i];
+		theta = 3.14159268 * (theta0 + ((double) i) * pDial->fSpan / nn) / 180.0;
+		pTick->x0 = x0 + pDial->fRadius * cos( theta );
+		pTick->y0 = y0 - pDial->fRadius * sin( theta );
+		pTick->nBig = !(i % pDial->nBigPer);
+		if ( !pTick->nBig )
+		{
+			pTick->x1 = x0 + (pDial->fRadius + pDial->fSizeTicks) * cos( theta );
+			pTick->y1 = y0 - (pDial->fRadius + pDial->fSizeTicks) * sin( theta );
+			continue;
+		}
+		pTick->x1 = x0 + (pDial->fRadius + pDial->fSizeBig) * cos( theta );
+		pTick->y1 = y0 - (pDial->fRadius + pDial->fSizeBig) * sin( theta );
+
+		/* Now need to annotate the big tick mark */
+		fCurrentIndication = pDial->fStartingIndicator + nBig * pDial->fIncrementPerBigTick;
+		nBig++;
+		snprintf(pTick->szLabel, sizeof(pTick->szLabel), szFormat, fCurrentIndication);
+		/* If the tick is near the top, center text over tick */
+		if ( fabs(theta - fTop) < fDelta )
+			pTick->nAlign = ALIGN_CENTER;
+		/* otherwise if the tick is on the left, start left of the tick */
+		else if ( theta < fTop )
+			pTick->nAlign = ALIGN_RIGHT;
+		/* Otherwise start at the tick */
+		else
+			pTick->nAlign = ALIGN_LEFT;
+	}
+}
+
+/*
+ * Font metrics.  Label widths come from AFM files, so that text can be
+ * placed here with a plain moveto and show instead of by stringwidth in
+ * the printer, and so that --check knows how far text reaches.  Only the
+ * directories given with --afm are searched, so the output does not
+ * depend on what the host has installed.  Fonts with no AFM file there
+ * are still placed by TC and TR, with an estimated width for the other
+ * formats.
+ */
+
+typedef struct
+{
+	char szName[64];
+	int nFound;                 /* 0 when no AFM file has this font */
+	short nWidth[256];          /* Advance of each code, 1/1000 of the size */
+} FONTMETRICS;
+
+FONTMETRICS *pFontMetrics;
+int nNumFontMetrics;
+int nMaxFontMetrics;
+const char *pszAfmPath = "";        /* Directories searched, : separated, from --afm */
+
+/* Read an AFM file if it is for pszFont, returns 1 if it was */
+static int readAfm( const char *pszPath, const char *pszFont, FONTMETRICS *pMetrics )
+{
+	char szLine[256];
+	int nCode, nWidth, nName;
+	FILE *f;
+
+	f = fopen(pszPath, "r");
+	if ( f == NULL )
+		return 0;
+	nName = 0;
+	while ( fgets(szLine, sizeof(szLine), f) != NULL )
+	{
+		trimLine(szLine);
+		if ( !strncmp("FontName ", szLine, 9) )
+		{
+			if ( strcmp(&szLine[9], pszFont) )
+				break;
+			nName = 1;
+		}
+		else if ( !strncmp("StartCharMetrics", szLine, 16) && !nName )
+			break;
+		else if ( nName && sscanf(szLine, "C %d ; WX %d", &nCode, &nWidth) == 2 && nCode >= 0 && nCode < 256 )
+			pMetrics->nWidth[nCode] = (short) nWidth;
+		else if ( !strncmp("EndCharMetrics", szLine, 14) )
+			break;
+	}
+	fclose(f);
+	return nName;
+}
+
+/* Look for the AFM file of a font, once per font name */
+void loadFontMetrics( const char *pszFont )
+{
+	FONTMETRICS *pMetrics;
+	char szDir[1024], szPath[1280];
+	const char *p, *pEnd;
+	struct dirent *pEntry;
+	size_t nLen;
+	DIR *pDir;
+	int i;
+
+	for ( i = 0; i < nNumFontMetrics; i++ )
+		if ( !strcmp(pFontMetrics[i].szName, pszFont) )
+			return;
+	pFontMetrics = growTable(pFontMetrics, &nMaxFontMetrics, nNumFontMetrics, 8, sizeof(FONTMETRICS));
+	pMetrics = &pFontMetrics[nNumFontMetrics++];
+	snprintf(pMetrics->szName, sizeof(pMetrics->szName), "%s", pszFont);
+
+	for ( p = pszAfmPath; *p && !pMetrics->nFound; p = *pEnd ? pEnd + 1 : pEnd )
+	{
+		pEnd = strchr(p, ':');
+		if ( pEnd == NULL )
+			pEnd = p + strlen(p);
+		nLen = pEnd - p;
+		if ( nLen == 0 || nLen >= sizeof(szDir) )
+			continue;
+		memcpy(szDir, p, nLen);
+		szDir[nLen] = '\0';
+
+		/* Usually the file is named for the font, otherwise check each one */
+		snprintf(szPath, sizeof(szPath), "%s/%s.afm", szDir, pszFont);
+		pMetrics->nFound = readAfm(szPath, pszFont, pMetrics);
+		if ( pMetrics->nFound || (pDir = opendir(szDir)) == NULL )
+			continue;
+		while ( !pMetrics->nFound && (pEntry = readdir(pDir)) != NULL )
+		{
+			nLen = strlen(pEntry->d_name);
+			if ( nLen < 4 || strcasecmp(&pEntry->d_name[nLen - 4], ".afm") )
+				continue;
+			snprintf(szPath, sizeof(szPath), "%s/%s", szDir, pEntry->d_name);
+			pMetrics->nFound = readAfm(szPath, pszFont, pMetrics);
+		}
+		closedir(pDir);
+	}
+}
+
+/* Metrics for every font the panel uses, before anything is drawn */
+void loadFonts( void )
+{
+	int i;
+
+	if ( nNumDials )
+		loadFontMetrics("Helvetica-Bold");
+	for ( i = 0; i < nNumStrings; i++ )
+		loadFontMetrics(rcText[i].szFont);
+}
+
+/* Metrics of a font loaded by loadFonts(), NULL if it has none */
+const FONTMETRICS *findFontMetrics( const char *pszFont )
+{
+	int i;
+
+	for ( i = 0; i < nNumFontMetrics; i++ )
+		if ( !strcmp(pFontMetrics[i].szName, pszFont) )
+			return pFontMetrics[i].nFound ? &pFontMetrics[i] : NULL;
+	return NULL;
+}
+
+/* Width of a PostScript string, escapes and all, from the font metrics */
+static double metricsWidth( const FONTMETRICS *pMetrics, const char *p, double fSize )
+{
+	long nTotal;
+	int c, n;
+
+	nTotal = 0;
+	while ( *p )
+	{
+		c = (unsigned char) *p++;
+		if ( c == '\\' && *p )
+		{
+			c = (unsigned char) *p++;
+			if ( c >= '0' && c <= '7' )
+			{
+				c -= '0';
+				for ( n = 1; n < 3 && *p >= '0' && *p <= '7'; n++ )
+					c = c * 8 + *p++ - '0';
+				c &= 0xff;
+			}
+			else if ( c == 'n' )
+				c = '\n';
+			else if ( c == 'r' )
+				c = '\r';
+			else if ( c == 't' )
+				c = '\t';
+			else if ( c == 'b' )
+				c = '\b';
+			else if ( c == 'f' )
+				c = '\f';
+		}
+		nTotal += pMetrics->nWidth[c];
+	}
+	return fSize * nTotal / 1000.0;
+}
+
+/* Width of a string, estimated at 0.6 em when the font has no metrics */
+double textWidth( const char *pszFont, const char *pszString, double fSize )
+{
+	const FONTMETRICS *pMetrics;
+
+	pMetrics = findFontMetrics(pszFont);
+	if ( pMetrics != NULL )
+		return metricsWidth(pMetrics, pszString, fSize);
+	return 0.6 * fSize * strlen(pszString);
+}
+
+/* Where text drawn at x starts, given its alignment */
+double alignText( const char *pszFont, const char *pszString, double fSize, double x, int nAlign )
+{
+	if ( nAlign == ALIGN_CENTER )
+		return x - textWidth(pszFont, pszString, fSize) / 2.0;
+	if ( nAlign == ALIGN_RIGHT )
+		return x - textWidth(pszFont, pszString, fSize);
+	return x;
+}
+
+/* Extent of a Text line, centered on its x with y at the baseline */
+void textExtent( int n, double *px0, double *py0, double *px1, double *py1 )
+{
+	double fWidth;
+
+	fWidth = textWidth(rcText[n].szFont, rcText[n].szString, rcText[n].size);
+	*px0 = rcText[n].x - fWidth / 2.0;
+	*px1 = rcText[n].x + fWidth / 2.0;
+	*py0 = rcText[n].y;
+	*py1 = rcText[n].y + rcText[n].size;
+}
+
+/* Work out the geometry of the panel in the tables, once per parse */
+void buildGeometry( void )
+{
+	CIRCLEGEOM *pCircle;
+	double theta;
+	int i;
+
+	if ( nGeometryBuilt )
+		return;
+	loadFonts();
+	for ( i = 0; i < FILLPOINTS; i++ )
+	{
+		theta = 6.28 * (double) i / 49.0;
+		fFillCircle[i][0] = sin( theta );
+		fFillCircle[i][1] = cos( theta );
+	}
+	for ( i = 0; i < OUTLINEPOINTS; i++ )
+	{
+		theta = 6.28 * (double) i / 99.0;
+		fOutlineCircle[i][0] = sin( theta );
+		fOutlineCircle[i][1] = cos( theta );
+	}
+
+	/* One set of circles per control size, the fill can be as coarse as half the outline */
+	nNumCircleGeom = 0;
+	for ( i = 0; fTolerance > 0.0 && i < nNumControls; i++ )
+	{
+		if ( controlCircle(rcControl[i].diam) != &circleFixed )
+			continue;
+		pCircleGeom = growTable(pCircleGeom, &nMaxCircleGeom, nNumCircleGeom, 8, sizeof(CIRCLEGEOM));
+		pCircle = &pCircleGeom[nNumCircleGeom++];
+		pCircle->fDiam = rcControl[i].diam;
+		pCircle->nOutline = arcSegments(pCircle->fDiam / 2.0, 360.0, fTolerance) + 1;
+		pCircle->pOutline = circlePoints(pCircle->pOutline, pCircle->nOutline);
+		pCircle->nFill = arcSegments(pCircle->fDiam / 2.0, 360.0, fTolerance + CONTROLLINE / 2.0) + 1;
+		pCircle->pFill = circlePoints(pCircle->pFill, pCircle->nFill);
+	}
+
+	if ( nNumDials > nMaxDialGeom )
+	{
+		pDialGeom = realloc(pDialGeom, nNumDials * sizeof(DIALGEOM));
+		if ( pDialGeom == NULL )
+		{
+			fprintf(stderr, "*** Error, out of memory. ***\n");
+			exit(8);
+		}
+		memset(pDialGeom + nMaxDialGeom, 0, (nNumDials - nMaxDialGeom) * sizeof(DIALGEOM));
+		nMaxDialGeom = nNumDials;
+	}
+	for ( i = 0; i < nNumDials; i++ )
+		buildDial(i, &pDialGeom[i]);
+	nGeometryBuilt = 1;
+}
+
+void addControl( double x0, double y0, double diam )
+{
+	const CIRCLEGEOM *pCircle;
+	double r;
+	int i;
+
+	r = diam / 2.0;
+	pCircle = controlCircle(diam);
+	addBuffer("0.1 W ");
+
+	for ( i = 0; i < pCircle->nFill; i++ )
+	{
+		if ( i )
+			addLine(x0 + r * pCircle->pFill[2 * i], y0 + r * pCircle->pFill[2 * i + 1]);
+		else
+			addMove(x0 + r * pCircle->pFill[2 * i], y0 + r * pCircle->pFill[2 * i + 1]);
+	}
+	/* Fill the circle with white */
+	addColor(0xffffff);
+	addBuffer("closepath fill ");
+
+	/* Outline it in black */
+	for ( i = 0; i < pCircle->nOutline; i++ )
+	{
+		if ( i )
+			addLine(x0 + r * pCircle->pOutline[2 * i], y0 + r * pCircle->pOutline[2 * i + 1]);
+		else
+			addMove(x0 + r * pCircle->pOutline[2 * i], y0 + r * pCircle->pOutline[2 * i + 1]);
+	}
+	addColor(0);
+	addBuffer("S ");
+
+	/* Add the crosshair */
+	addMove(x0 - r, y0);
+	addLine(x0 + r, y0);
+	addBuffer("S ");
+	addMove(x0, y0 - r);
+	addLine(x0, y0 + r);
+	addBuffer("S ");
+}
+
+void addString( int n )
+{
+	char szWork[128];
+	char *p;
+
+	/* Font size */
+	sprintf(szWork, "%6.2f ", rcText[n].size);
+	p = szWork;
+	while ( *p == ' ')
+		p++;
+	addBuffer(p);
+	/* Font name */
+	sprintf(szWork, "/%s ", rcText[n].szFont);
+	addBuffer(szWork);
+	addBuffer("F ");
+
+	addColor(rcText[n].crColor);
+
+	/* With metrics the centered start is worked out here, spaces included */
+	if ( findFontMetrics(rcText[n].szFont) != NULL )
+	{
+		addMove(alignText(rcText[n].szFont, rcText[n].szString, rcText[n].size, rcText[n].x, ALIGN_CENTER)
+		        - textWidth(rcText[n].szFont, " ", rcText[n].size), rcText[n].y);
+		addBuffer("( ");
+		addBuffer(rcText[n].szString);
+		addBuffer(" ) T ");
+		return;
+	}
+
+	sprintf(szWork, "%7.2f ", rcText[n].x);
+	p = szWork;
+	while ( *p == ' ')
+		p++;
+	addBuffer(p);
+
+	sprintf(szWork, "%7.2f ", rcText[n].y);
+	p = szWork;
+	while ( *p == ' ')
+		p++;
+	addBuffer(p);
+	addBuffer("M ");
+
+	addBuffer("( ");
+	addBuffer(rcText[n].szString);
+	addBuffer(" ) TC ");
+}
+
+void addDial( int nDialNum )
+{
+	int i, nMetrics;
+	char szWork[132];
+	DIALGEOM *pGeom;
+	TICK *pTick;
+	char *p;
+
+	pGeom = &pDialGeom[nDialNum];
+	nMetrics = findFontMetrics("Helvetica-Bold") != NULL;
+
+	/* Draw circle */
+
+	/* Make the circle bolder for larger dials */
+	if ( rcDial[nDialNum].fRadius > 400.0 )
+		addBuffer("gsave 0.677 W ");
+	else
+		addBuffer("gsave 0.339 W ");
+
+	addColor(rcDial[nDialNum].crCircle);
+
+	for ( i = 0; i < pGeom->nArc; i++ )
+	{
+		if ( i )
+			addLine(pGeom->pArc[2 * i], pGeom->pArc[2 * i + 1]);
+		else
+			addMove(pGeom->pArc[2 * i], pGeom->pArc[2 * i + 1]);
+	}
+	addBuffer("S grestore ");
+
+	/* Draw ticks and annotation */
+
+	if ( rcDial[nDialNum].fSizeTicks > 20.0 )           /* Use a heavier line if ticks are long */
+		addBuffer("gsave 0.339 W ");
+	else
+		addBuffer("gsave 0.169 W ");
+	addColor(rcDial[nDialNum].crTickMarks);             /* Color of small tick marks */
+
+	/* Set up the font of the right size */
+	sprintf(szWork, "%6.2f ", rcDial[nDialNum].fSizeFont);
+	p = szWork;
+	while ( *p == ' ')
+		p++;
+	addBuffer(p);
+	addBuffer("/Helvetica-Bold ");
+	addBuffer("F ");
+
+	/* Loop through all the ticks */
+	for ( i = 0; i < pGeom->nTicks; i++ )
+	{
+		pTick = &pGeom->pTicks[i];
+		addMove(pTick->x0, pTick->y0);
+
+		if ( !pTick->nBig )
+		{
+			addLine(pTick->x1, pTick->y1);
+			addBuffer("S ");
+		}
+		else
+		{
+			addColor(rcDial[nDialNum].crBigTickMarks);
+			addLine(pTick->x1, pTick->y1);
+			addBuffer("S ");
+
+			/* Now need to annotate the big tick mark */
+			addColor(rcDial[nDialNum].crText);          /* Set text color */
+			if ( nMetrics )
+			{
+				addMove(alignText("Helvetica-Bold", pTick->szLabel, rcDial[nDialNum].fSizeFont, pTick->x1, pTick->nAlign),
+				        pTick->y1);
+				sprintf(szWork, "(%s) T ", pTick->szLabel);
+				addBuffer(szWork);
+				addColor(rcDial[nDialNum].crTickMarks);
+				continue;
+			}
+			addMove(pTick->x1, pTick->y1);
+			sprintf(szWork, "(%s) ", pTick->szLabel);
+			addBuffer(szWork);
+			if ( pTick->nAlign == ALIGN_CENTER )
+				addBuffer("TC ");
+			else if ( pTick->nAlign == ALIGN_RIGHT )
+				addBuffer("TR ");
+			else
+				addBuffer("T ");
+			/* Reset to small tick color */
+			addColor(rcDial[nDialNum].crTickMarks);
+		}
+	}
+
+	/* Finally, place a drilling crosshair */
+	addColor(0);
+	addMove(rcDial[nDialNum].x0 - 4, rcDial[nDialNum].y0);
+	addLine(rcDial[nDialNum].x0 + 4, rcDial[nDialNum].y0);
+	addBuffer("S ");
+	addMove(rcDial[nDialNum].x0, rcDial[nDialNum].y0 - 4);
+	addLine(rcDial[nDialNum].x0, rcDial[nDialNum].y0 + 4);
+	addBuffer("S ");
+
+	addBuffer("grestore ");
+}
+
+void addRectangle( double x0, double y0, double width, double height )
+{
+	addBuffer("0.1 W ");
+
+	addMove(x0, y0);
+	addLine(x0 + width, y0);
+	addLine(x0 + width, y0 + height);
+	addLine(x0, y0 + height);
+
+	addBuffer("closepath S ");
+}
+
+void addRectCenter( double x, double y, double width, double height )
+{
+	double a, b, x0, y0;
+	a = width / 2.0;
+	b = height / 2.0;
+	x0 = x - a;
+	y0 = y - b;
+
+	addBuffer("0.1 W ");
+
+	addMove(x0, y0);
+	addLine(x0 + width, y0);
+	addLine(x0 + width, y0 + height);
+	addLine(x0, y0 + height);
+
+	addBuffer("closepath S ");
+}
+
+/* Corners of cutout n, the rectangles and then the centered rectangles, low corner first */
+static void cutoutBox( int n, double *px0, double *py0, double *px1, double *py1 )
+{
+	double t;
+
+	if ( n < nNumRectangles )
+	{
+		*px0 = rcRectangle[n].x0;
+		*py0 = rcRectangle[n].y0;
+		*px1 = *px0 + rcRectangle[n].fRectangleWidth;
+		*py1 = *py0 + rcRectangle[n].fRectangleHeight;
+	}
+	else
+	{
+		n -= nNumRectangles;
+		*px0 = rcRectCenter[n].x - rcRectCenter[n].fRectangleWidth / 2.0;
+		*py0 = rcRectCenter[n].y - rcRectCenter[n].fRectangleHeight / 2.0;
+		*px1 = *px0 + rcRectCenter[n].fRectangleWidth;
+		*py1 = *py0 + rcRectCenter[n].fRectangleHeight;
+	}
+
+	/* A negative size draws the other way */
+	if ( *px0 > *px1 )
+	{
+		t = *px0;
+		*px0 = *px1;
+		*px1 = t;
+	}
+	if ( *py0 > *py1 )
+	{
+		t = *py0;
+		*py0 = *py1;
+		*py1 = t;
+	}
+}
+
+char szPaperSizes[9][16] =
+{ "letter", "a4", "legal", "a3", "11x17", "a1", "archD", "a0", "b0" };
+
+double fPaperWidths[9] =
+{ 21.59, 20.9903, 21.59, 29.7039, 27.94, 59.4078, 60.96, 93.9611, 100.048 };
+
+double fPaperHeights[9] =
+{ 27.94, 29.7039, 35.56, 41.9806, 43.18, 83.9611, 91.44, 118.816, 141.393 };
+
+void CalcPageSize( void )
+{
+	// double fPrintableWidth;
+	// double fPrintableHeight;
+	// char szPagesize[32];
+	double fWidths[9], fHeights[9];
+	int nPage;
+	int i;
+
+	// Values in paper table are from gs_statd.ps and need to be converted
+	// Assumption is 12.7 mm margin all around (0.5 in)
+	// Converted into locals so a long-lived process can call this per render
+	for ( i = 0; i < 9; i++ )
+	{
+		fWidths[i] = 10.0 * fPaperWidths[i] - 25.4;
+		fHeights[i] = 10.0 * fPaperHeights[i] - 25.4;
+	}
+
+	// Tiles are always on the paper asked for
+	if ( nTilePaper >= 0 )
+	{
+		fPrintableWidth = fWidths[nTilePaper];
+		fPrintableHeight = fHeights[nTilePaper];
+		strcpy(szPagesize, szPaperSizes[nTilePaper]);
+		return;
+	}
+
+	// Initially assume we will fit on letter size paper
+	nPage = 0;
+	fPrintableWidth = fWidths[0];
+	fPrintableHeight = fHeights[0];
+
+	// Now test each paper size to see what we can fit this panel on to
+	for ( i = 0; i < 8; i++ )
+	{
+		if ( fPanelHeight > fPrintableWidth )
+		{
+			//	  fprintf(stderr,"Panel is too high for %s. (%f > %f)\n",szPaperSizes[nPage],fPanelHeight,fPrintableWidth);
+			nPage = i + 1;
+			fPrintableWidth = fWidths[nPage];
+			fPrintableHeight = fHeights[nPage];
+		}
+		if ( fPanelWidth > fPrintableHeight )
+		{
+			//	  fprintf(stderr,"Panel is too wide for %s. (%f > %f)\n",szPaperSizes[nPage],fPanelWidth,fPrintableHeight);
+			nPage = i + 1;
+			fPrintableWidth = fWidths[nPage];
+			fPrintableHeight = fHeights[nPage];
+		}
+	}
+
+	// Need to have the paper size name for warning at end of program
+	strcpy(szPagesize, szPaperSizes[nPage]);
+}
+
+/* Draw element n of the panel, in the order controls, rectangles, dials, text */
+void emitElement( int n )
+{
+	if ( n < nNumControls )
+	{
+		addControl( rcControl[n].x, rcControl[n].y, rcControl[n].diam );
+		return;
+	}
+	n -= nNumControls;
+	if ( n < nNumRectangles )
+	{
+		addRectangle( rcRectangle[n].x0, rcRectangle[n].y0, rcRectangle[n].fRectangleWidth, rcRectangle[n].fRectangleHeight );
+		return;
+	}
+	n -= nNumRectangles;
+	if ( n < nNumCtrRectangles )
+	{
+		addRectCenter( rcRectCenter[n].x, rcRectCenter[n].y, rcRectCenter[n].fRectangleWidth, rcRectCenter[n].fRectangleHeight);
+		return;
+	}
+	n -= nNumCtrRectangles;
+	if ( n < nNumDials )
+	{
+		addDial( n );
+		return;
+	}
+	n -= nNumDials;
+	addString( n );
+}
+
+int countElements( void )
+{
+	return nNumControls + nNumRectangles + nNumCtrRectangles + nNumDials + nNumStrings;
+}
+
+/*
+ * Parallel emission.  Render threads take elements in order and draw each
+ * one into its own fragment, which keeps the addBuffer() tokens apart.  The
+ * calling thread replays the finished fragments through addBuffer() in
+ * draw order, so the lines break exactly where a serial render puts them.
+ * Threads stay at most a window of elements ahead of the output to bound
+ * the memory held in fragments.
+ */
+#define MINPARALLEL 64          /* Fewer elements are not worth the threads */
+#define FRAGMENTWINDOW 256      /* Elements rendered ahead, per thread */
+
+static struct
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	FRAGMENT *pFragments;
+	int nElements;
+	int nNext;                  /* Next element to render */
+	int nConsumed;              /* Elements already replayed */
+	int nWindow;
+} emPool;
+
+static void *emitThread( void *pArg )
+{
+	FRAGMENT *pFrag;
+	int n;
+
+	(void) pArg;
+	for ( ;; )
+	{
+		pthread_mutex_lock(&emPool.mtx);
+		while ( emPool.nNext < emPool.nElements && emPool.nNext >= emPool.nConsumed + emPool.nWindow )
+			pthread_cond_wait(&emPool.cond, &emPool.mtx);
+		n = emPool.nNext++;
+		pthread_mutex_unlock(&emPool.mtx);
+		if ( n >= emPool.nElements )
+			return NULL;
+
+		pFrag = &emPool.pFragments[n];
+		pFragment = pFrag;
+		nBytesSaved = 0;
+		emitElement(n);
+		pFrag->nSaved = nBytesSaved;
+		pFragment = NULL;
+
+		pthread_mutex_lock(&emPool.mtx);
+		pFrag->nDone = 1;
+		pthread_cond_broadcast(&emPool.cond);
+		pthread_mutex_unlock(&emPool.mtx);
+	}
+}
+
+/* Replay a finished fragment into the output buffer */
+void replayFragment( FRAGMENT *pFrag )
+{
+	size_t n;
+
+	for ( n = 0; n < pFrag->nText; n += strlen(&pFrag->pText[n]) + 1 )
+		addBuffer(&pFrag->pText[n]);
+	nBytesSaved += pFrag->nSaved;
+}
+
+/* Emit every element using nThreads render threads */
+void emitParallel( int nThreads )
+{
+	pthread_t *pThreads;
+	int i, nStarted;
+
+	emPool.nElements = countElements();
+	emPool.pFragments = calloc(emPool.nElements, sizeof(FRAGMENT));
+	pThreads = malloc(nThreads * sizeof(pthread_t));
+	if ( emPool.pFragments == NULL || pThreads == NULL )
+	{
+		free(emPool.pFragments);
+		free(pThreads);
+		for ( i = 0; i < countElements(); i++ )
+			emitElement(i);
+		return;
+	}
+	emPool.nNext = 0;
+	emPool.nConsumed = 0;
+	emPool.nWindow = FRAGMENTWINDOW * nThreads;
+	pthread_mutex_init(&emPool.mtx, NULL);
+	pthread_cond_init(&emPool.cond, NULL);
+
+	for ( nStarted = 0; nStarted < nThreads; nStarted++ )
+		if ( pthread_create(&pThreads[nStarted], NULL, emitThread, NULL) )
+			break;
+
+	for ( i = 0; i < emPool.nElements; i++ )
+	{
+		pthread_mutex_lock(&emPool.mtx);
+		if ( nStarted == 0 && emPool.nNext <= i )
+		{
+			/* No threads would start, do it here */
+			emPool.nNext = i + 1;
+			pthread_mutex_unlock(&emPool.mtx);
+			emitElement(i);
+			continue;
+		}
+		while ( !emPool.pFragments[i].nDone )
+			pthread_cond_wait(&emPool.cond, &emPool.mtx);
+		pthread_mutex_unlock(&emPool.mtx);
+
+		replayFragment(&emPool.pFragments[i]);
+		free(emPool.pFragments[i].pText);
+		emPool.pFragments[i].pText = NULL;
+
+		pthread_mutex_lock(&emPool.mtx);
+		emPool.nConsumed = i + 1;
+		pthread_cond_broadcast(&emPool.cond);
+		pthread_mutex_unlock(&emPool.mtx);
+	}
+
+	for ( i = 0; i < nStarted; i++ )
+		pthread_join(pThreads[i], NULL);
+	pthread_cond_destroy(&emPool.cond);
+	pthread_mutex_destroy(&emPool.mtx);
+	free(emPool.pFragments);
+	free(pThreads);
+}
+
+/* The panel background and outline */
+void addOutline( void )
+{
+	char szWork[132];
+
+	addBuffer("gsave 0.2 W ");
+
+	addColor( crBackground );
+	addBuffer("newpath ");
+
+	addBuffer("0 0 M ");
+	sprintf(szWork, "%f 0 L ", fPanelWidth);
+	addBuffer(szWork);
+	sprintf(szWork, "%f %f L ", fPanelWidth, fPanelHeight);
+	addBuffer(szWork);
+	sprintf(szWork, "0 %f L ", fPanelHeight);
+	addBuffer(szWork);
+	addBuffer("0 0 L ");
+	addBuffer("closepath fill ");
+
+	addColor(0);
+	addBuffer("0 0 M ");
+	sprintf(szWork, "%f 0 L ", fPanelWidth);
+	addBuffer(szWork);
+	sprintf(szWork, "%f %f L ", fPanelWidth, fPanelHeight);
+	addBuffer(szWork);
+	sprintf(szWork, "0 %f L ", fPanelHeight);
+	addBuffer(szWork);
+	addBuffer("0 0 L ");
+	addBuffer("S ");
+	addBuffer("grestore ");
+}
+
+/*
+ * Tiled output, for panels bigger than the paper.  --tile=<paper> cuts the
+ * panel into landscape pages of that size which overlap by --overlap mm,
+ * with registration marks in the overlaps to line the sheets up.  The
+ * elements are put in buckets of one tile step each, so a page only looks
+ * at the elements near it and draws those that reach into it, under a
+ * clip to the tile.  Pages are drawn on the render threads into fragments
+ * and written in order, a window of pages ahead at most.
+ */
+#define TILEWINDOW 2            /* Pages rendered ahead, per thread */
+#define MARKRADIUS 2.0          /* Registration mark circle, mm */
+#define MARKARM 4.0             /* Registration mark cross, mm each way */
+#define TILESTROKE 0.5          /* Boxes grow by this for the lines, half of 0.677 mm and the corners */
+
+static struct
+{
+	int nCols, nRows;
+	double fStepX, fStepY;      /* Tile size less the overlap, also the bucket size */
+	double fTileW, fTileH;
+	double *pBoxes;             /* x0, y0, x1, y1 of each element */
+	int *pnCellStart;           /* Bucket i holds pnCellItems[pnCellStart[i]..pnCellStart[i + 1]) */
+	int *pnCellItems;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	FRAGMENT *pFragments;
+	int nNext;                  /* Next page to render */
+	int nConsumed;              /* Pages already written */
+	int nWindow;
+} tilePool;
+
+/* Lay the tiles out over the panel, returns the number of pages */
+int setupTiles( void )
+{
+	tilePool.fTileW = fPrintableHeight;     /* Pages are landscape */
+	tilePool.fTileH = fPrintableWidth;
+	tilePool.fStepX = tilePool.fTileW - fTileOverlap;
+	tilePool.fStepY = tilePool.fTileH - fTileOverlap;
+	tilePool.nCols = fPanelWidth > tilePool.fTileW ? (int) ceil((fPanelWidth - fTileOverlap) / tilePool.fStepX) : 1;
+	tilePool.nRows = fPanelHeight > tilePool.fTileH ? (int) ceil((fPanelHeight - fTileOverlap) / tilePool.fStepY) : 1;
+	return tilePool.nCols * tilePool.nRows;
+}
+
+/* Bounding box of element n, in the order of emitElement() */
+void elementExtent( int n, double *px0, double *py0, double *px1, double *py1 )
+{
+	double r, w;
+	int i;
+
+	if ( n < nNumControls )
+	{
+		r = rcControl[n].diam / 2.0;
+		*px0 = rcControl[n].x - r;
+		*py0 = rcControl[n].y - r;
+		*px1 = rcControl[n].x + r;
+		*py1 = rcControl[n].y + r;
+		return;
+	}
+	n -= nNumControls;
+	if ( n < nNumRectangles + nNumCtrRectangles )
+	{
+		cutoutBox(n, px0, py0, px1, py1);
+		return;
+	}
+	n -= nNumRectangles + nNumCtrRectangles;
+	if ( n < nNumDials )
+	{
+		/* Widest number past the big ticks, and the 4 mm crosshair */
+		w = 0.0;
+		for ( i = 0; i < pDialGeom[n].nTicks; i++ )
+			if ( pDialGeom[n].pTicks[i].nBig )
+				w = fmax(w, textWidth("Helvetica-Bold", pDialGeom[n].pTicks[i].szLabel, rcDial[n].fSizeFont));
+		r = fmax(4.0, rcDial[n].fRadius + fmax(rcDial[n].fSizeTicks, rcDial[n].fSizeBig) + rcDial[n].fSizeFont + w);
+		*px0 = rcDial[n].x0 - r;
+		*py0 = rcDial[n].y0 - r;
+		*px1 = rcDial[n].x0 + r;
+		*py1 = rcDial[n].y0 + r;
+		return;
+	}
+	n -= nNumDials;
+
+	/* The width may only be an estimate, so allow a character each side */
+	textExtent(n, px0, py0, px1, py1);
+	*px0 -= rcText[n].size;
+	*px1 += rcText[n].size;
+	*py0 -= rcText[n].size / 2.0;
+}
+
+/* Buckets a box covers, clamped to the tile grid */
+static void tileCells( const double *pBox, int *pcx0, int *pcy0, int *pcx1, int *pcy1 )
+{
+	*pcx0 = (int) fmax(0.0, fmin(tilePool.nCols - 1, floor(pBox[0] / tilePool.fStepX)));
+	*pcy0 = (int) fmax(0.0, fmin(tilePool.nRows - 1, floor(pBox[1] / tilePool.fStepY)));
+	*pcx1 = (int) fmax(0.0, fmin(tilePool.nCols - 1, floor(pBox[2] / tilePool.fStepX)));
+	*pcy1 = (int) fmax(0.0, fmin(tilePool.nRows - 1, floor(pBox[3] / tilePool.fStepY)));
+}
+
+/* Put every element in the buckets its box covers */
+static int buildTileIndex( void )
+{
+	int nElements, nCells, i, cx, cy, cx0, cy0, cx1, cy1;
+	int *pnCursor;
+
+	nElements = countElements();
+	nCells = tilePool.nCols * tilePool.nRows;
+	tilePool.pBoxes = malloc((nElements + 1) * 4 * sizeof(double));
+	tilePool.pnCellStart = calloc(nCells + 1, sizeof(int));
+	pnCursor = calloc(nCells, sizeof(int));
+	if ( tilePool.pBoxes == NULL || tilePool.pnCellStart == NULL || pnCursor == NULL )
+	{
+		free(pnCursor);
+		return -1;
+	}
+	for ( i = 0; i < nElements; i++ )
+	{
+		elementExtent(i, &tilePool.pBoxes[4 * i], &tilePool.pBoxes[4 * i + 1],
+		              &tilePool.pBoxes[4 * i + 2], &tilePool.pBoxes[4 * i + 3]);
+		tilePool.pBoxes[4 * i] -= TILESTROKE;
+		tilePool.pBoxes[4 * i + 1] -= TILESTROKE;
+		tilePool.pBoxes[4 * i + 2] += TILESTROKE;
+		tilePool.pBoxes[4 * i + 3] += TILESTROKE;
+		tileCells(&tilePool.pBoxes[4 * i], &cx0, &cy0, &cx1, &cy1);
+		for ( cy = cy0; cy <= cy1; cy++ )
+			for ( cx = cx0; cx <= cx1; cx++ )
+				tilePool.pnCellStart[cy * tilePool.nCols + cx + 1]++;
+	}
+	for ( i = 0; i < nCells; i++ )
+		tilePool.pnCellStart[i + 1] += tilePool.pnCellStart[i];
+	tilePool.pnCellItems = malloc((tilePool.pnCellStart[nCells] + 1) * sizeof(int));
+	if ( tilePool.pnCellItems == NULL )
+	{
+		free(pnCursor);
+		return -1;
+	}
+	/* Elements go in in draw order, so each bucket is sorted */
+	for ( i = 0; i < nElements; i++ )
+	{
+		tileCells(&tilePool.pBoxes[4 * i], &cx0, &cy0, &cx1, &cy1);
+		for ( cy = cy0; cy <= cy1; cy++ )
+			for ( cx = cx0; cx <= cx1; cx++ )
+				tilePool.pnCellItems[tilePool.pnCellStart[cy * tilePool.nCols + cx] + pnCursor[cy * tilePool.nCols + cx]++] = i;
+	}
+	free(pnCursor);
+	return 0;
+}
+
+static int compareInts( const void *a, const void *b )
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* A registration mark, if it falls on the tile */
+static void addMark( double x, double y, double tx, double ty )
+{
+	char szWork[80];
+
+	if ( x < tx || x > tx + tilePool.fTileW || y < ty || y > ty + tilePool.fTileH )
+		return;
+	addMove(x - MARKARM, y);
+	addLine(x + MARKARM, y);
+	addBuffer("S ");
+	addMove(x, y - MARKARM);
+	addLine(x, y + MARKARM);
+	addBuffer("S ");
+	sprintf(szWork, "%f %f %.1f 0 360 arc S ", x, y, MARKRADIUS);
+	addBuffer(szWork);
+}
+
+/*
+ * Draw page n, the tiles run left to right from the top.  pnSeen is one
+ * entry per element, all -1 the first time, and pnList as long.
+ */
+static void emitTile( int n, int *pnSeen, int *pnList )
+{
+	char szWork[160];
+	double tx, ty, fLeft, fBottom, fMid;
+	const double *pBox;
+	int nCol, nRow, nList, i, j, k, cx, cy, cx0, cy0, cx1, cy1;
+	double rcTile[4];
+
+	nCol = n % tilePool.nCols;
+	nRow = tilePool.nRows - 1 - n / tilePool.nCols;
+	tx = nCol * tilePool.fStepX;
+	ty = nRow * tilePool.fStepY;
+
+	/* The tile's corner goes to the corner of the printable area */
+	fLeft = 12.7 - tx;
+	fBottom = -fPrintableWidth - 12.7 - ty;
+	if ( nReverse )
+		sprintf(szWork, "90 rotate -2.83464567 2.83464567 scale %f %f translate ", fLeft - 25.4 - fPrintableHeight, fBottom);
+	else
+		sprintf(szWork, "90 rotate 2.83464567 2.83464567 scale %f %f translate ", fLeft, fBottom);
+	addBuffer(szWork);
+	sprintf(szWork, "newpath %f %f M %f %f L %f %f L %f %f L closepath clip newpath ",
+	        tx, ty, tx + tilePool.fTileW, ty, tx + tilePool.fTileW, ty + tilePool.fTileH, tx, ty + tilePool.fTileH);
+	addBuffer(szWork);
+	addOutline();
+
+	/* Everything in the buckets under the tile that reaches into it, in draw order */
+	rcTile[0] = tx;
+	rcTile[1] = ty;
+	rcTile[2] = tx + tilePool.fTileW;
+	rcTile[3] = ty + tilePool.fTileH;
+	tileCells(rcTile, &cx0, &cy0, &cx1, &cy1);
+	nList = 0;
+	for ( cy = cy0; cy <= cy1; cy++ )
+		for ( cx = cx0; cx <= cx1; cx++ )
+			for ( j = tilePool.pnCellStart[cy * tilePool.nCols + cx]; j < tilePool.pnCellStart[cy * tilePool.nCols + cx + 1]; j++ )
+			{
+				i = tilePool.pnCellItems[j];
+				pBox = &tilePool.pBoxes[4 * i];
+				if ( pnSeen[i] == n || pBox[0] > rcTile[2] || pBox[2] < rcTile[0] || pBox[1] > rcTile[3] || pBox[3] < rcTile[1] )
+					continue;
+				pnSeen[i] = n;
+				pnList[nList++] = i;
+			}
+	qsort(pnList, nList, sizeof(int), compareInts);
+	for ( i = 0; i < nList; i++ )
+		emitElement(pnList[i]);
+
+	/* Marks down the middle of each overlap, at the middle of each tile and where overlaps cross */
+	addBuffer("0.1 W ");
+	addColor(0);
+	for ( j = 1; j < tilePool.nCols; j++ )
+	{
+		fMid = j * tilePool.fStepX + fTileOverlap / 2.0;
+		for ( k = 0; k < tilePool.nRows; k++ )
+		{
+			addMark(fMid, k * tilePool.fStepY + tilePool.fTileH / 2.0, tx, ty);
+			if ( k )
+				addMark(fMid, k * tilePool.fStepY + fTileOverlap / 2.0, tx, ty);
+		}
+	}
+	for ( k = 1; k < tilePool.nRows; k++ )
+	{
+		fMid = k * tilePool.fStepY + fTileOverlap / 2.0;
+		for ( j = 0; j < tilePool.nCols; j++ )
+			addMark(j * tilePool.fStepX + tilePool.fTileW / 2.0, fMid, tx, ty);
+	}
+}
+
+static void *tileThread( void *pArg )
+{
+	FRAGMENT *pFrag;
+	int *pnSeen;
+	int n;
+
+	pnSeen = pArg;
+	for ( ;; )
+	{
+		pthread_mutex_lock(&tilePool.mtx);
+		while ( tilePool.nNext < tilePool.nCols * tilePool.nRows && tilePool.nNext >= tilePool.nConsumed + tilePool.nWindow )
+			pthread_cond_wait(&tilePool.cond, &tilePool.mtx);
+		n = tilePool.nNext++;
+		pthread_mutex_unlock(&tilePool.mtx);
+		if ( n >= tilePool.nCols * tilePool.nRows )
+			return NULL;
+
+		pFrag = &tilePool.pFragments[n];
+		pFragment = pFrag;
+		nBytesSaved = 0;
+		emitTile(n, pnSeen, pnSeen + countElements());
+		pFrag->nSaved = nBytesSaved;
+		pFragment = NULL;
+
+		pthread_mutex_lock(&tilePool.mtx);
+		pFrag->nDone = 1;
+		pthread_cond_broadcast(&tilePool.cond);
+		pthread_mutex_unlock(&tilePool.mtx);
+	}
+}
+
+/* The pages of a tiled panel, after the header */
+void renderTiles( void )
+{
+	pthread_t *pThreads;
+	int **ppnSeen;
+	int nTiles, nElements, nWorkers, nStarted, i;
+
+	nElements = countElements();
+	nTiles = tilePool.nCols * tilePool.nRows;
+	nWorkers = nThreads > nTiles ? nTiles : nThreads;
+	if ( nWorkers < 1 )
+		nWorkers = 1;
+	tilePool.pFragments = calloc(nTiles, sizeof(FRAGMENT));
+	pThreads = malloc(nWorkers * sizeof(pthread_t));
+	ppnSeen = calloc(nWorkers, sizeof(int *));
+	if ( buildTileIndex() || tilePool.pFragments == NULL || pThreads == NULL || ppnSeen == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	for ( i = 0; i < nWorkers; i++ )
+	{
+		ppnSeen[i] = malloc((2 * nElements + 1) * sizeof(int));
+		if ( ppnSeen[i] == NULL )
+		{
+			fprintf(stderr, "*** Error, out of memory. ***\n");
+			exit(8);
+		}
+		memset(ppnSeen[i], 0xff, nElements * sizeof(int));
+	}
+	tilePool.nNext = 0;
+	tilePool.nConsumed = 0;
+	tilePool.nWindow = TILEWINDOW * nWorkers;
+	pthread_mutex_init(&tilePool.mtx, NULL);
+	pthread_cond_init(&tilePool.cond, NULL);
+
+	nStarted = 0;
+	if ( nWorkers > 1 )
+		for ( ; nStarted < nWorkers; nStarted++ )
+			if ( pthread_create(&pThreads[nStarted], NULL, tileThread, ppnSeen[nStarted]) )
+				break;
+
+	for ( i = 0; i < nTiles; i++ )
+	{
+		if ( nBufferLen )
+			purgeBuffer();
+		nBytesOut += fprintf(fOut, "%%%%Page: (%d,%d) %d\r\n", i / tilePool.nCols + 1, i % tilePool.nCols + 1, i + 1);
+		if ( nStarted == 0 )
+		{
+			/* No threads, draw it here */
+			emitTile(i, ppnSeen[0], ppnSeen[0] + nElements);
+		}
+		else
+		{
+			pthread_mutex_lock(&tilePool.mtx);
+			while ( !tilePool.pFragments[i].nDone )
+				pthread_cond_wait(&tilePool.cond, &tilePool.mtx);
+			pthread_mutex_unlock(&tilePool.mtx);
+
+			replayFragment(&tilePool.pFragments[i]);
+			free(tilePool.pFragments[i].pText);
+			tilePool.pFragments[i].pText = NULL;
+
+			pthread_mutex_lock(&tilePool.mtx);
+			tilePool.nConsumed = i + 1;
+			pthread_cond_broadcast(&tilePool.cond);
+			pthread_mutex_unlock(&tilePool.mtx);
+		}
+		addBuffer("showpage ");
+	}
+
+	for ( i = 0; i < nStarted; i++ )
+		pthread_join(pThreads[i], NULL);
+	pthread_cond_destroy(&tilePool.cond);
+	pthread_mutex_destroy(&tilePool.mtx);
+	for ( i = 0; i < nWorkers; i++ )
+		free(ppnSeen[i]);
+	free(ppnSeen);
+	free(pThreads);
+	free(tilePool.pFragments);
+	free(tilePool.pBoxes);
+	free(tilePool.pnCellStart);
+	free(tilePool.pnCellItems);
+	tilePool.pBoxes = NULL;
+	tilePool.pnCellStart = NULL;
+	tilePool.pnCellItems = NULL;
+}
+
+/* Emit the complete PostScript for the panel currently in the tables */
+void renderPanel( void )
+{
+	int i;
+	char szWork[132];
+	double fPanelLeftCorner, fPanelBottomCorner;
+
+	CalcPageSize();
+	buildGeometry();
+	nBytesOut = 0;
+	nBytesSaved = 0;
+	memset(szBuffer, 0, sizeof(szBuffer));
+	nBufferLen = 0;
+	if ( nTilePaper >= 0 )
+	{
+		addHeader(setupTiles());
+		renderTiles();
+		purgeBuffer();
+		nBytesOut += fprintf(fOut, "%%%%Trailer\r\n");
+		return;
+	}
+	addHeader(1);
+	nBytesOut += fprintf(fOut, "%%%%Page: 1 1\r\n");
+
+	/* Calculate location of panel corner.  */
+	fPanelLeftCorner = (fPrintableHeight - fPanelWidth) / 2.0 + 12.7;
+	fPanelBottomCorner = (fPrintableWidth - fPanelHeight) / 2.0 - fPrintableWidth - 12.7;
+	if ( nReverse )
+	{
+		sprintf(szWork, "90 rotate -2.83464567 2.83464567 scale %f %f translate ", fPanelLeftCorner - fPrintableHeight, fPanelBottomCorner);
+		addBuffer(szWork);
+	}
+	else
+	{
+		sprintf(szWork, "90 rotate 2.83464567 2.83464567 scale %f %f translate ", fPanelLeftCorner, fPanelBottomCorner);
+		addBuffer(szWork);
+	}
+
+	/* Draw panel outline */
+	addOutline();
+
+
+
+	if ( pElementCache == NULL && nThreads > 1 && countElements() >= MINPARALLEL )
+		emitParallel( nThreads );
+	else
+		for ( i = 0; i < countElements(); i++ )
+			if ( pElementCache != NULL && pElementCache[i].nDone )
+				replayFragment( &pElementCache[i] );
+			else
+				emitElement( i );
+
+	addBuffer("showpage ");
+	purgeBuffer();
+	nBytesOut += fprintf(fOut, "%%%%Trailer\r\n");
+}
+
+/*
+ * Other output formats.  Each writer draws the same tables and the same
+ * buildGeometry() points as the PostScript, into its own stream, so that
+ * several can run at once from one parse.
+ */
+#define FORMAT_PS 0
+#define FORMAT_SVG 1
+#define FORMAT_PDF 2
+#define FORMAT_DRILL 3
+#define FORMAT_GERBER 4         /* Several files, see writeGerber() */
+
+char *szFormatNames[] = { "ps", "svg", "pdf", "drill", "gerber" };
+
+/* Look up a format name, -1 if unknown */
+int findFormat( const char *pszName, size_t nLen )
+{
+	int i;
+
+	for ( i = 0; i < (int) (sizeof(szFormatNames) / sizeof(szFormatNames[0])); i++ )
+		if ( strlen(szFormatNames[i]) == nLen && !strncmp(szFormatNames[i], pszName, nLen) )
+			return i;
+	return -1;
+}
+
+/* Shortest form of a coordinate to a thousandth of a millimeter */
+static char *formatNumber( char *p, double x )
+{
+	char *q;
+
+	sprintf(p, "%.3f", x);
+	q = p + strlen(p) - 1;
+	while ( *q == '0' )
+		*q-- = '\0';
+	if ( *q == '.' )
+		*q = '\0';
+	if ( !strcmp(p, "-0") )
+		strcpy(p, "0");
+	return p;
+}
+
+/* A polyline from x, y pairs as SVG points or PDF operators */
+static void writePoints( FILE *f, int nFormat, const double *pXY, int nStep, int n, double x0, double y0, double r )
+{
+	char szX[32], szY[32];
+	int i;
+
+	for ( i = 0; i < n; i++ )
+	{
+		formatNumber(szX, x0 + r * pXY[i * nStep]);
+		formatNumber(szY, y0 + r * pXY[i * nStep + 1]);
+		if ( nFormat == FORMAT_SVG )
+			fprintf(f, "%s%s,%s", i ? " " : "", szX, szY);
+		else
+			fprintf(f, "%s %s %s\n", szX, szY, i ? "l" : "m");
+	}
+}
+
+/* Font families for SVG from PostScript names like Arial-BoldItalicMT */
+static void writeSvgFont( FILE *f, const char *pszFont, double fSize )
+{
+	char szFamily[32];
+	char *p;
+
+	strncpy(szFamily, pszFont, sizeof(szFamily) - 1);
+	szFamily[sizeof(szFamily) - 1] = '\0';
+	p = strchr(szFamily, '-');
+	if ( p != NULL )
+		*p = '\0';
+	fprintf(f, "font-family=\"%s\" font-size=\"%g\"", szFamily, fSize);
+	if ( strstr(pszFont, "Bold") != NULL )
+		fprintf(f, " font-weight=\"bold\"");
+	if ( strstr(pszFont, "Italic") != NULL || strstr(pszFont, "Oblique") != NULL )
+		fprintf(f, " font-style=\"italic\"");
+}
+
+static void writeSvgText( FILE *f, const char *pszString )
+{
+	for ( ; *pszString; pszString++ )
+		if ( *pszString == '&' )
+			fputs("&amp;", f);
+		else if ( *pszString == '<' )
+			fputs("&lt;", f);
+		else if ( *pszString == '>' )
+			fputs("&gt;", f);
+		else
+			fputc(*pszString, f);
+}
+
+static void writeSvgLabel( FILE *f, double x, double y, const char *pszFont, double fSize,
+                           COLORREF cr, int nAlign, const char *pszString )
+{
+	char szX[32], szY[32];
+	static const char *szAnchor[] = { "start", "middle", "end" };
+
+	/* Text is drawn upright in the flipped panel coordinates */
+	fprintf(f, "<text transform=\"translate(%s,%s) scale(1,-1)\" fill=\"#%06lx\" text-anchor=\"%s\" ",
+	        formatNumber(szX, x), formatNumber(szY, y), cr & 0xffffff, szAnchor[nAlign]);
+	writeSvgFont(f, pszFont, fSize);
+	fprintf(f, ">");
+	writeSvgText(f, pszString);
+	fprintf(f, "</text>\n");
+}
+
+/* SVG in millimeters, with y flipped so the panel coordinates carry over */
+int writeSvg( FILE *f )
+{
+	const CIRCLEGEOM *pCircle;
+	DIALGEOM *pGeom;
+	TICK *pTick;
+	char szX[32], szY[32], szW[32], szH[32];
+	double x0, y0, w, h;
+	int i, j;
+
+	formatNumber(szW, fPanelWidth);
+	formatNumber(szH, fPanelHeight);
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(f, "<!-- Panel from file %s, rcrpanel " REVISION " -->\n", szFilename);
+	fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%smm\" height=\"%smm\" viewBox=\"0 0 %s %s\">\n",
+	        szW, szH, szW, szH);
+	if ( nReverse )
+		fprintf(f, "<g transform=\"matrix(-1 0 0 -1 %s %s)\" stroke-linecap=\"butt\">\n", szW, szH);
+	else
+		fprintf(f, "<g transform=\"matrix(1 0 0 -1 0 %s)\" stroke-linecap=\"butt\">\n", szH);
+
+	/* Panel outline */
+	fprintf(f, "<rect x=\"0\" y=\"0\" width=\"%s\" height=\"%s\" fill=\"#%06lx\" stroke=\"#000000\" stroke-width=\"0.2\"/>\n",
+	        szW, szH, crBackground & 0xffffff);
+
+	for ( i = 0; i < nNumControls; i++ )
+	{
+		x0 = rcControl[i].x;
+		y0 = rcControl[i].y;
+		w = rcControl[i].diam / 2.0;
+		pCircle = controlCircle(rcControl[i].diam);
+		fprintf(f, "<polygon fill=\"#ffffff\" stroke=\"none\" points=\"");
+		writePoints(f, FORMAT_SVG, pCircle->pFill, 2, pCircle->nFill, x0, y0, w);
+		fprintf(f, "\"/>\n<polyline fill=\"none\" stroke=\"#000000\" stroke-width=\"0.1\" points=\"");
+		writePoints(f, FORMAT_SVG, pCircle->pOutline, 2, pCircle->nOutline, x0, y0, w);
+		fprintf(f, "\"/>\n<path stroke=\"#000000\" stroke-width=\"0.1\" d=\"M%s,", formatNumber(szX, x0 - w));
+		fprintf(f, "%sH", formatNumber(szY, y0));
+		fprintf(f, "%sM", formatNumber(szX, x0 + w));
+		fprintf(f, "%s,", formatNumber(szX, x0));
+		fprintf(f, "%sV", formatNumber(szY, y0 - w));
+		fprintf(f, "%s\"/>\n", formatNumber(szY, y0 + w));
+	}
+
+	for ( i = 0; i < nNumRectangles + nNumCtrRectangles; i++ )
+	{
+		if ( i < nNumRectangles )
+		{
+			x0 = rcRectangle[i].x0;
+			y0 = rcRectangle[i].y0;
+			w = rcRectangle[i].fRectangleWidth;
+			h = rcRectangle[i].fRectangleHeight;
+		}
+		else
+		{
+			j = i - nNumRectangles;
+			w = rcRectCenter[j].fRectangleWidth;
+			h = rcRectCenter[j].fRectangleHeight;
+			x0 = rcRectCenter[j].x - w / 2.0;
+			y0 = rcRectCenter[j].y - h / 2.0;
+		}
+		fprintf(f, "<path fill=\"none\" stroke=\"#000000\" stroke-width=\"0.1\" d=\"M%s,", formatNumber(szX, x0));
+		fprintf(f, "%sh", formatNumber(szY, y0));
+		fprintf(f, "%sv", formatNumber(szX, w));
+		fprintf(f, "%sh", formatNumber(szY, h));
+		fprintf(f, "%sz\"/>\n", formatNumber(szX, -w));
+	}
+
+	for ( i = 0; i < nNumDials; i++ )
+	{
+		pGeom = &pDialGeom[i];
+		fprintf(f, "<polyline fill=\"none\" stroke=\"#%06lx\" stroke-width=\"%s\" points=\"",
+		        rcDial[i].crCircle & 0xffffff, rcDial[i].fRadius > 400.0 ? "0.677" : "0.339");
+		writePoints(f, FORMAT_SVG, pGeom->pArc, 2, pGeom->nArc, 0.0, 0.0, 1.0);
+		fprintf(f, "\"/>\n");
+		fprintf(f, "<g stroke-width=\"%s\">\n", rcDial[i].fSizeTicks > 20.0 ? "0.339" : "0.169");
+		for ( j = 0; j < pGeom->nTicks; j++ )
+		{
+			pTick = &pGeom->pTicks[j];
+			fprintf(f, "<path stroke=\"#%06lx\" d=\"M%s,", (pTick->nBig ? rcDial[i].crBigTickMarks : rcDial[i].crTickMarks) & 0xffffff,
+			        formatNumber(szX, pTick->x0));
+			fprintf(f, "%sL", formatNumber(szY, pTick->y0));
+			fprintf(f, "%s,", formatNumber(szX, pTick->x1));
+			fprintf(f, "%s\"/>\n", formatNumber(szY, pTick->y1));
+			if ( pTick->nBig )
+				writeSvgLabel(f, pTick->x1, pTick->y1, "Helvetica-Bold", rcDial[i].fSizeFont,
+				              rcDial[i].crText, pTick->nAlign, pTick->szLabel);
+		}
+		fprintf(f, "<path stroke=\"#000000\" d=\"M%s,", formatNumber(szX, rcDial[i].x0 - 4));
+		fprintf(f, "%sh8M", formatNumber(szY, rcDial[i].y0));
+		fprintf(f, "%s,", formatNumber(szX, rcDial[i].x0));
+		fprintf(f, "%sv8\"/>\n</g>\n", formatNumber(szY, rcDial[i].y0 - 4));
+	}
+
+	for ( i = 0; i < nNumStrings; i++ )
+		writeSvgLabel(f, rcText[i].x, rcText[i].y, rcText[i].szFont, rcText[i].size,
+		              rcText[i].crColor, ALIGN_CENTER, rcText[i].szString);
+
+	fprintf(f, "</g>\n</svg>\n");
+	return ferror(f) ? -1 : 0;
+}
+
+/* Set both PDF colors, as setrgbcolor does */
+static void writePdfColor( FILE *f, COLORREF cr )
+{
+	double r, g, b;
+
+	/* The same scale and rounding as addColor(), so PDF matches the PostScript */
+	r = ((cr & 0xff0000) >> 16) / 256.0;
+	g = ((cr & 0xff00) >> 8) / 256.0;
+	b = (cr & 0xff) / 256.0;
+	fprintf(f, "%.2f %.2f %.2f RG %.2f %.2f %.2f rg\n", r, g, b, r, g, b);
+}
+
+static void writePdfLabel( FILE *f, int nFont, const char *pszFont, double fSize, double x, double y,
+                           int nAlign, const char *pszString )
+{
+	char szX[32], szY[32];
+	const char *p;
+
+	x = alignText(pszFont, pszString, fSize, x, nAlign);
+	fprintf(f, "BT /F%d %g Tf %s %s Td (", nFont, fSize, formatNumber(szX, x), formatNumber(szY, y));
+	for ( p = pszString; *p; p++ )
+	{
+		if ( *p == '(' || *p == ')' || *p == '\\' )
+			fputc('\\', f);
+		fputc(*p, f);
+	}
+	fprintf(f, ") Tj ET\n");
+}
+
+/* Index of a font in the PDF font list, adding it if new */
+static int pdfFont( char ***pppszFonts, int *pnFonts, const char *pszFont )
+{
+	char **ppsz;
+	int i;
+
+	for ( i = 0; i < *pnFonts; i++ )
+		if ( !strcmp((*pppszFonts)[i], pszFont) )
+			return i + 1;
+	ppsz = realloc(*pppszFonts, (*pnFonts + 1) * sizeof(char *));
+	if ( ppsz == NULL || (ppsz[*pnFonts] = strdup(pszFont)) == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	*pppszFonts = ppsz;
+	return ++*pnFonts;
+}
+
+/* A one page PDF the size of the panel, the fonts are not embedded */
+int writePdf( FILE *f )
+{
+	const CIRCLEGEOM *pCircle;
+	DIALGEOM *pGeom;
+	TICK *pTick;
+	FILE *fContent;
+	char *pContent;
+	size_t nContent;
+	char **ppszFonts;
+	int nFonts;
+	long *pnOffsets;
+	long nPos, nXref;
+	char szX[32], szY[32], szW[32], szH[32];
+	double x0, y0, w, h;
+	int i, j, nObjects;
+
+	/* Draw into memory first, the length goes ahead of the stream */
+	pContent = NULL;
+	nContent = 0;
+	fContent = open_memstream(&pContent, &nContent);
+	if ( fContent == NULL )
+		return -1;
+	ppszFonts = NULL;
+	nFonts = 0;
+	pdfFont(&ppszFonts, &nFonts, "Helvetica-Bold");
+
+	if ( nReverse )
+		fprintf(fContent, "-2.83464567 0 0 2.83464567 %.4f 0 cm\n", fPanelWidth * 2.83464567);
+	else
+		fprintf(fContent, "2.83464567 0 0 2.83464567 0 0 cm\n");
+	formatNumber(szW, fPanelWidth);
+	formatNumber(szH, fPanelHeight);
+	writePdfColor(fContent, crBackground);
+	fprintf(fContent, "0 0 %s %s re f\n0 G 0.2 w 0 0 %s %s re S\n", szW, szH, szW, szH);
+
+	for ( i = 0; i < nNumControls; i++ )
+	{
+		x0 = rcControl[i].x;
+		y0 = rcControl[i].y;
+		w = rcControl[i].diam / 2.0;
+		pCircle = controlCircle(rcControl[i].diam);
+		fprintf(fContent, "0.1 w 1 g\n");
+		writePoints(fContent, FORMAT_PDF, pCircle->pFill, 2, pCircle->nFill, x0, y0, w);
+		fprintf(fContent, "h f 0 G\n");
+		writePoints(fContent, FORMAT_PDF, pCircle->pOutline, 2, pCircle->nOutline, x0, y0, w);
+		fprintf(fContent, "S %s ", formatNumber(szX, x0 - w));
+		fprintf(fContent, "%s m ", formatNumber(szY, y0));
+		fprintf(fContent, "%s %s l S ", formatNumber(szX, x0 + w), szY);
+		fprintf(fContent, "%s ", formatNumber(szX, x0));
+		fprintf(fContent, "%s m ", formatNumber(szY, y0 - w));
+		fprintf(fContent, "%s %s l S\n", szX, formatNumber(szY, y0 + w));
+	}
+
+	for ( i = 0; i < nNumRectangles + nNumCtrRectangles; i++ )
+	{
+		if ( i < nNumRectangles )
+		{
+			x0 = rcRectangle[i].x0;
+			y0 = rcRectangle[i].y0;
+			w = rcRectangle[i].fRectangleWidth;
+			h = rcRectangle[i].fRectangleHeight;
+		}
+		else
+		{
+			j = i - nNumRectangles;
+			w = rcRectCenter[j].fRectangleWidth;
+			h = rcRectCenter[j].fRectangleHeight;
+			x0 = rcRectCenter[j].x - w / 2.0;
+			y0 = rcRectCenter[j].y - h / 2.0;
+		}
+		fprintf(fContent, "0 G 0.1 w %s ", formatNumber(szX, x0));
+		fprintf(fContent, "%s ", formatNumber(szY, y0));
+		fprintf(fContent, "%s ", formatNumber(szX, w));
+		fprintf(fContent, "%s re S\n", formatNumber(szY, h));
+	}
+
+	for ( i = 0; i < nNumDials; i++ )
+	{
+		pGeom = &pDialGeom[i];
+		fprintf(fContent, "%s w\n", rcDial[i].fRadius > 400.0 ? "0.677" : "0.339");
+		writePdfColor(fContent, rcDial[i].crCircle);
+		writePoints(fContent, FORMAT_PDF, pGeom->pArc, 2, pGeom->nArc, 0.0, 0.0, 1.0);
+		fprintf(fContent, "S %s w\n", rcDial[i].fSizeTicks > 20.0 ? "0.339" : "0.169");
+		for ( j = 0; j < pGeom->nTicks; j++ )
+		{
+			pTick = &pGeom->pTicks[j];
+			writePdfColor(fContent, pTick->nBig ? rcDial[i].crBigTickMarks : rcDial[i].crTickMarks);
+			fprintf(fContent, "%s ", formatNumber(szX, pTick->x0));
+			fprintf(fContent, "%s m ", formatNumber(szY, pTick->y0));
+			fprintf(fContent, "%s ", formatNumber(szX, pTick->x1));
+			fprintf(fContent, "%s l S\n", formatNumber(szY, pTick->y1));
+			if ( pTick->nBig )
+			{
+				writePdfColor(fContent, rcDial[i].crText);
+				writePdfLabel(fContent, 1, "Helvetica-Bold", rcDial[i].fSizeFont, pTick->x1, pTick->y1,
+				              pTick->nAlign, pTick->szLabel);
+			}
+		}
+		fprintf(fContent, "0 G %s ", formatNumber(szX, rcDial[i].x0 - 4));
+		fprintf(fContent, "%s m ", formatNumber(szY, rcDial[i].y0));
+		fprintf(fContent, "%s %s l S ", formatNumber(szX, rcDial[i].x0 + 4), szY);
+		fprintf(fContent, "%s ", formatNumber(szX, rcDial[i].x0));
+		fprintf(fContent, "%s m ", formatNumber(szY, rcDial[i].y0 - 4));
+		fprintf(fContent, "%s %s l S\n", szX, formatNumber(szY, rcDial[i].y0 + 4));
+	}
+
+	for ( i = 0; i < nNumStrings; i++ )
+	{
+		writePdfColor(fContent, rcText[i].crColor);
+		writePdfLabel(fContent, pdfFont(&ppszFonts, &nFonts, rcText[i].szFont), rcText[i].szFont,
+		              rcText[i].size, rcText[i].x, rcText[i].y, ALIGN_CENTER, rcText[i].szString);
+	}
+	if ( fclose(fContent) )
+		return -1;
+
+	/* Catalog, pages, page, content, then one object per font */
+	nObjects = 4 + nFonts;
+	pnOffsets = calloc(nObjects + 1, sizeof(long));
+	if ( pnOffsets == NULL )
+	{
+		for ( i = 0; i < nFonts; i++ )
+			free(ppszFonts[i]);
+		free(ppszFonts);
+		free(pContent);
+		errno = ENOMEM;
+		return -1;
+	}
+	nPos = fprintf(f, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+	pnOffsets[1] = nPos;
+	nPos += fprintf(f, "1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+	pnOffsets[2] = nPos;
+	nPos += fprintf(f, "2 0 obj\n<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n");
+	pnOffsets[3] = nPos;
+	nPos += fprintf(f, "3 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %.2f %.2f]\n",
+	                fPanelWidth * 2.83464567, fPanelHeight * 2.83464567);
+	nPos += fprintf(f, "/Resources << /Font <<");
+	for ( i = 0; i < nFonts; i++ )
+		nPos += fprintf(f, " /F%d %d 0 R", i + 1, 5 + i);
+	nPos += fprintf(f, " >> >>\n/Contents 4 0 R >>\nendobj\n");
+	pnOffsets[4] = nPos;
+	nPos += fprintf(f, "4 0 obj\n<< /Length %lu >>\nstream\n", (unsigned long) nContent);
+	nPos += fwrite(pContent, 1, nContent, f);
+	nPos += fprintf(f, "\nendstream\nendobj\n");
+	for ( i = 0; i < nFonts; i++ )
+	{
+		pnOffsets[5 + i] = nPos;
+		nPos += fprintf(f, "%d 0 obj\n<< /Type /Font /Subtype /Type1 /BaseFont /%s >>\nendobj\n", 5 + i, ppszFonts[i]);
+		free(ppszFonts[i]);
+	}
+	nXref = nPos;
+	fprintf(f, "xref\n0 %d\n0000000000 65535 f \n", nObjects + 1);
+	for ( i = 1; i <= nObjects; i++ )
+		fprintf(f, "%010ld 00000 n \n", pnOffsets[i]);
+	fprintf(f, "trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%ld\n%%%%EOF\n", nObjects + 1, nXref);
+
+	free(ppszFonts);
+	free(pnOffsets);
+	free(pContent);
+	return ferror(f) ? -1 : 0;
+}
+
+static int compareDiameters( const void *a, const void *b )
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Sorted control hole sizes, each once, returns how many or -1 */
+int holeSizes( double **ppfSizes )
+{
+	double *pf;
+	int n, i;
+
+	pf = malloc((nNumControls + 1) * sizeof(double));
+	*ppfSizes = pf;
+	if ( pf == NULL )
+		return -1;
+	for ( i = 0; i < nNumControls; i++ )
+		pf[i] = rcControl[i].diam;
+	qsort(pf, nNumControls, sizeof(double), compareDiameters);
+	for ( n = 0, i = 0; i < nNumControls; i++ )
+		if ( n == 0 || pf[i] != pf[n - 1] )
+			pf[n++] = pf[i];
+	return n;
+}
+
+/* Excellon drill file for the control holes, one tool per diameter */
+int writeDrill( FILE *f )
+{
+	double *pfTools;
+	int nTools, i, j;
+
+	nTools = holeSizes(&pfTools);
+	if ( nTools < 0 )
+		return -1;
+
+	fprintf(f, "M48\n; Panel from file %s, rcrpanel " REVISION "\nMETRIC\n", szFilename);
+	for ( i = 0; i < nTools; i++ )
+		fprintf(f, "T%02dC%.3f\n", i + 1, pfTools[i]);
+	fprintf(f, "%%\nG90\nG05\n");
+	for ( i = 0; i < nTools; i++ )
+	{
+		fprintf(f, "T%02d\n", i + 1);
+		for ( j = 0; j < nNumControls; j++ )
+			if ( rcControl[j].diam == pfTools[i] )
+				fprintf(f, "X%.3fY%.3f\n", rcControl[j].x, rcControl[j].y);
+	}
+	fprintf(f, "M30\n");
+	free(pfTools);
+	return ferror(f) ? -1 : 0;
+}
+
+/*
+ * Gerber X2, for panels made as circuit boards.  --out gerber:name writes
+ * name-Copper.gbr, name-Mask.gbr, name-Legend.gbr, name-Profile.gbr and
+ * name-NPTH.gbr.  Each hole is one flash of a circular aperture for its
+ * size and each dial scale one arc, so nothing is cut into segments.
+ * The copper is a pour over the panel, cleared around the holes, the
+ * cutouts and the edge.  The legend has the dial scales and ticks; Gerber
+ * has no fonts, so text is left to the other formats.
+ */
+#define GERBERCLEARANCE 0.5     /* Copper pulled back from holes, cutouts and edge */
+#define GERBERMASKMARGIN 0.05   /* Solder mask opening beyond a hole or cutout */
+
+static void gerberPoint( FILE *f, double x, double y, int nOp )
+{
+	fprintf(f, "X%lldY%lldD%02d*\n", llround(x * 1e6), llround(y * 1e6), nOp);
+}
+
+/* A filled rectangle in the current polarity, grown by fMargin */
+static void gerberBox( FILE *f, double x0, double y0, double x1, double y1, double fMargin )
+{
+	fprintf(f, "G36*\n");
+	gerberPoint(f, x0 - fMargin, y0 - fMargin, 2);
+	gerberPoint(f, x1 + fMargin, y0 - fMargin, 1);
+	gerberPoint(f, x1 + fMargin, y1 + fMargin, 1);
+	gerberPoint(f, x0 - fMargin, y1 + fMargin, 1);
+	gerberPoint(f, x0 - fMargin, y0 - fMargin, 1);
+	fprintf(f, "G37*\n");
+}
+
+/* The scale of dial n as one arc, clockwise for a positive span as on paper */
+static void gerberArc( FILE *f, int n )
+{
+	double theta, x0, y0, x1, y1, r;
+
+	r = rcDial[n].fRadius;
+	theta = 90.0 + (360.0 - rcDial[n].fSpan) / 2.0 + rcDial[n].fStartAngle;
+	x0 = rcDial[n].x0 + r * cos(3.14159268 * theta / 180.0);
+	y0 = rcDial[n].y0 - r * sin(3.14159268 * theta / 180.0);
+	if ( fabs(rcDial[n].fSpan) >= 360.0 )
+	{
+		/* Equal ends are a whole circle */
+		x1 = x0;
+		y1 = y0;
+	}
+	else
+	{
+		theta += rcDial[n].fSpan;
+		x1 = rcDial[n].x0 + r * cos(3.14159268 * theta / 180.0);
+		y1 = rcDial[n].y0 - r * sin(3.14159268 * theta / 180.0);
+
+		/* Too short to tell the ends apart, which would also read as a circle */
+		if ( llround(x0 * 1e6) == llround(x1 * 1e6) && llround(y0 * 1e6) == llround(y1 * 1e6) )
+			return;
+	}
+	gerberPoint(f, x0, y0, 2);
+	fprintf(f, "%sX%lldY%lldI%lldJ%lldD01*\nG01*\n", rcDial[n].fSpan < 0.0 ? "G03" : "G02",
+	        llround(x1 * 1e6), llround(y1 * 1e6),
+	        llround((rcDial[n].x0 - x0) * 1e6), llround((rcDial[n].y0 - y0) * 1e6));
+}
+
+/* Flash every hole, with apertures from D10 up the hole sizes plus fGrow */
+static void gerberHoles( FILE *f, const double *pfSizes, int nSizes, double fGrow, const char *pszFunction )
+{
+	int i, j;
+
+	for ( i = 0; i < nSizes; i++ )
+	{
+		if ( pszFunction != NULL )
+			fprintf(f, "%%TA.AperFunction,%s*%%\n", pszFunction);
+		fprintf(f, "%%ADD%dC,%.4f*%%\n", 10 + i, pfSizes[i] + 2.0 * fGrow);
+	}
+	if ( pszFunction != NULL )
+		fprintf(f, "%%TD*%%\n");
+	for ( i = 0; i < nSizes; i++ )
+	{
+		fprintf(f, "D%d*\n", 10 + i);
+		for ( j = 0; j < nNumControls; j++ )
+			if ( rcControl[j].diam == pfSizes[i] )
+				gerberPoint(f, rcControl[j].x, rcControl[j].y, 3);
+	}
+}
+
+static FILE *openGerber( const char *pszBase, const char *pszLayer, const char *pszFunction, const char *pszPolarity )
+{
+	char szPath[1024];
+	FILE *f;
+
+	snprintf(szPath, sizeof(szPath), "%s-%s.gbr", pszBase, pszLayer);
+	f = fopen(szPath, "w");
+	if ( f == NULL )
+	{
+		perror(szPath);
+		return NULL;
+	}
+	fprintf(f, "G04 %s layer, rcrpanel " REVISION "*\n", pszLayer);
+	fprintf(f, "%%TF.GenerationSoftware,rcrpanel,rcrpanel," REVISION "*%%\n");
+	fprintf(f, "%%TF.FileFunction,%s*%%\n", pszFunction);
+	fprintf(f, "%%TF.FilePolarity,%s*%%\n", pszPolarity);
+	fprintf(f, "%%FSLAX46Y46*%%\n%%MOMM*%%\n%%LPD*%%\nG01*\n");
+	return f;
+}
+
+static int closeGerber( FILE *f, const char *pszBase, const char *pszLayer )
+{
+	int nError;
+
+	fprintf(f, "M02*\n");
+	nError = ferror(f);
+	if ( fclose(f) || nError )
+	{
+		fprintf(stderr, "*** Error, could not write %s-%s.gbr ***\n", pszBase, pszLayer);
+		return -1;
+	}
+	return 0;
+}
+
+int writeGerber( const char *pszBase )
+{
+	DIALGEOM *pGeom;
+	double *pfSizes;
+	double x0, y0, x1, y1;
+	int nSizes, nResult, i, j;
+	FILE *f;
+
+	nSizes = holeSizes(&pfSizes);
+	if ( nSizes < 0 )
+		return -1;
+	nResult = 0;
+
+	/* Copper pour, cleared around everything that goes through */
+	f = openGerber(pszBase, "Copper", "Copper,L1,Top", "Positive");
+	if ( f != NULL )
+	{
+		gerberBox(f, 0.0, 0.0, fPanelWidth, fPanelHeight, -GERBERCLEARANCE);
+		fprintf(f, "%%LPC*%%\n");
+		gerberHoles(f, pfSizes, nSizes, GERBERCLEARANCE, NULL);
+		for ( i = 0; i < nNumRectangles + nNumCtrRectangles; i++ )
+		{
+			cutoutBox(i, &x0, &y0, &x1, &y1);
+			gerberBox(f, x0, y0, x1, y1, GERBERCLEARANCE);
+		}
+		nResult |= closeGerber(f, pszBase, "Copper");
+	}
+	else
+		nResult = -1;
+
+	/* Solder mask openings */
+	f = openGerber(pszBase, "Mask", "Soldermask,Top", "Negative");
+	if ( f != NULL )
+	{
+		gerberHoles(f, pfSizes, nSizes, GERBERMASKMARGIN, NULL);
+		for ( i = 0; i < nNumRectangles + nNumCtrRectangles; i++ )
+		{
+			cutoutBox(i, &x0, &y0, &x1, &y1);
+			gerberBox(f, x0, y0, x1, y1, GERBERMASKMARGIN);
+		}
+		nResult |= closeGerber(f, pszBase, "Mask");
+	}
+	else
+		nResult = -1;
+
+	/* Dial scales as clockwise arcs, with the line widths of the PostScript */
+	f = openGerber(pszBase, "Legend", "Legend,Top", "Positive");
+	if ( f != NULL )
+	{
+		fprintf(f, "%%ADD10C,0.169*%%\n%%ADD11C,0.339*%%\n%%ADD12C,0.677*%%\nG75*\n");
+		for ( i = 0; i < nNumDials; i++ )
+		{
+			pGeom = &pDialGeom[i];
+			if ( pGeom->nArc > 1 )
+			{
+				fprintf(f, "D%d*\n", rcDial[i].fRadius > 400.0 ? 12 : 11);
+				gerberArc(f, i);
+			}
+			fprintf(f, "D%d*\n", rcDial[i].fSizeTicks > 20.0 ? 11 : 10);
+			for ( j = 0; j < pGeom->nTicks; j++ )
+			{
+				gerberPoint(f, pGeom->pTicks[j].x0, pGeom->pTicks[j].y0, 2);
+				gerberPoint(f, pGeom->pTicks[j].x1, pGeom->pTicks[j].y1, 1);
+			}
+		}
+		nResult |= closeGerber(f, pszBase, "Legend");
+	}
+	else
+		nResult = -1;
+
+	/* Board edge and the cutouts to route */
+	f = openGerber(pszBase, "Profile", "Profile,NP", "Positive");
+	if ( f != NULL )
+	{
+		fprintf(f, "%%TA.AperFunction,Profile*%%\n%%ADD10C,0.1000*%%\n%%TD*%%\nD10*\n");
+		for ( i = -1; i < nNumRectangles + nNumCtrRectangles; i++ )
+		{
+			if ( i < 0 )
+			{
+				x0 = y0 = 0.0;
+				x1 = fPanelWidth;
+				y1 = fPanelHeight;
+			}
+			else
+				cutoutBox(i, &x0, &y0, &x1, &y1);
+			gerberPoint(f, x0, y0, 2);
+			gerberPoint(f, x1, y0, 1);
+			gerberPoint(f, x1, y1, 1);
+			gerberPoint(f, x0, y1, 1);
+			gerberPoint(f, x0, y0, 1);
+		}
+		nResult |= closeGerber(f, pszBase, "Profile");
+	}
+	else
+		nResult = -1;
+
+	/* Holes, all unplated */
+	f = openGerber(pszBase, "NPTH", "NonPlated,1,1,NPTH,Drill", "Positive");
+	if ( f != NULL )
+	{
+		gerberHoles(f, pfSizes, nSizes, 0.0, "MechanicalDrill");
+		nResult |= closeGerber(f, pszBase, "NPTH");
+	}
+	else
+		nResult = -1;
+
+	free(pfSizes);
+	return nResult;
+}
+
+/* Write one format to a stream, returns 0 or -1 */
+int writeFormat( int nFormat, FILE *f )
+{
+	buildGeometry();
+	switch ( nFormat )
+	{
+	case FORMAT_SVG:
+		return writeSvg(f);
+	case FORMAT_PDF:
+		return writePdf(f);
+	case FORMAT_DRILL:
+		return writeDrill(f);
+	default:
+		fOut = f;
+		renderPanel();
+		fOut = stdout;
+		return ferror(f) ? -1 : 0;
+	}
+}
+
+/*
+ * --out format:file, given any number of times.  The script is parsed and
+ * the geometry built once; every format other than PostScript is then
+ * written on a thread of its own while the PostScript, which owns the line
+ * buffer, is written here.
+ */
+typedef struct
+{
+	int nFormat;
+	char *pszPath;
+	FILE *f;
+	int nResult;
+	pthread_t thread;
+	int nThread;
+} OUTPUT;
+
+static void *outputThread( void *pArg )
+{
+	OUTPUT *pOutput = pArg;
+
+	if ( pOutput->nFormat == FORMAT_GERBER )
+		pOutput->nResult = writeGerber(pOutput->pszPath);
+	else
+		pOutput->nResult = writeFormat(pOutput->nFormat, pOutput->f);
+	return NULL;
+}
+
+int writeOutputs( OUTPUT *pOutputs, int nOutputs )
+{
+	int i, nResult;
+
+	buildGeometry();
+	for ( i = 0; i < nOutputs; i++ )
+	{
+		/* Gerber opens its own files, one per layer */
+		pOutputs[i].f = NULL;
+		if ( pOutputs[i].nFormat == FORMAT_GERBER )
+			continue;
+		pOutputs[i].f = fopen(pOutputs[i].pszPath, "w");
+		if ( pOutputs[i].f == NULL )
+		{
+			perror(pOutputs[i].pszPath);
+			while ( i-- )
+				if ( pOutputs[i].f != NULL )
+					fclose(pOutputs[i].f);
+			return 8;
+		}
+	}
+	for ( i = 0; i < nOutputs; i++ )
+		pOutputs[i].nThread = pOutputs[i].nFormat != FORMAT_PS
+		                      && !pthread_create(&pOutputs[i].thread, NULL, outputThread, &pOutputs[i]);
+	for ( i = 0; i < nOutputs; i++ )
+		if ( !pOutputs[i].nThread )
+			outputThread(&pOutputs[i]);
+
+	nResult = 0;
+	for ( i = 0; i < nOutputs; i++ )
+	{
+		if ( pOutputs[i].nThread )
+			pthread_join(pOutputs[i].thread, NULL);
+		if ( pOutputs[i].f != NULL && fclose(pOutputs[i].f) )
+			pOutputs[i].nResult = -1;
+		if ( pOutputs[i].nResult )
+		{
+			/* writeGerber() reports its own files */
+			if ( pOutputs[i].nFormat != FORMAT_GERBER )
+				perror(pOutputs[i].pszPath);
+			nResult = 8;
+		}
+	}
+	return nResult;
+}
+
+/*
+ * Variant sweeps, --vars file.csv.  The first line of the CSV names the
+ * variables and each further line is one variant.  A column named output
+ * gives the file to write, otherwise it is the script name with the row
+ * number and .ps.  The script is read once with the defaults and every
+ * element that no variable touches is drawn once into a fragment.  Each
+ * variant then reads again only the lines whose variables it changes, and
+ * renders in a process of its own, up to --threads at a time.
+ */
+
+/* Split a CSV line in place, a quoted field may hold commas and "" */
+static int splitCsv( char *p, char **ppFields, int nMax )
+{
+	char *q;
+	int n, nQuoted;
+
+	p[strcspn(p, "\r\n")] = '\0';
+	for ( n = 0; ; p++ )
+	{
+		q = p;
+		if ( n < nMax )
+			ppFields[n] = q;
+		n++;
+		for ( nQuoted = 0; *p && (nQuoted || *p != ','); p++ )
+		{
+			if ( *p == '"' && nQuoted && p[1] == '"' )
+				*q++ = *p++;
+			else if ( *p == '"' )
+				nQuoted = !nQuoted;
+			else
+				*q++ = *p;
+		}
+		if ( *p == '\0' )
+		{
+			*q = '\0';
+			return n;
+		}
+		*q = '\0';
+	}
+}
+
+/* Whether a line refers to a variable the variant has changed */
+static int lineChanged( const char *p )
+{
+	VARIABLE *pVar;
+	size_t nLen;
+
+	for ( ; (p = strchr(p, '$')) != NULL; p += nLen + 1 )
+	{
+		nLen = nameLength(p + 1);
+		pVar = findVariable(p + 1, nLen);
+		if ( pVar != NULL && strcmp(variableValue(pVar), defaultValue(pVar)) )
+			return 1;
+	}
+	return 0;
+}
+
+/* Render one variant in a child process, returns the exit status */
+static int renderVariant( char *pszTemplate, size_t nTemplate, const int *pnColumnVars,
+                          char **ppFields, int nColumns, char *pszPath, int nFormat )
+{
+	char szName[sizeof(szFilename)];
+	int anFinal[5];
+	VARLINE *pLine;
+	size_t nPrefix;
+	int i, nReparse;
+	FILE *f;
+
+	for ( i = 0; i < nColumns; i++ )
+		if ( pnColumnVars[i] >= 0 )
+			pVariables[pnColumnVars[i]].pszValue = ppFields[i];
+	f = fopen("/dev/null", "w");
+	if ( f != NULL )
+		fLog = f;
+
+	/* A changed If adds or drops entries and a changed Panel line moves everything, so then read the whole script */
+	nReparse = 0;
+	for ( i = 0; i < nNumVarLines; i++ )
+		if ( (pVarLines[i].nIf && testCondition(pVarLines[i].pszText, 0, &nPrefix) != testCondition(pVarLines[i].pszText, 1, &nPrefix))
+		     || (pVarLines[i].nPanel && lineChanged(pVarLines[i].pszText)) )
+			nReparse = 1;
+	if ( nReparse )
+	{
+		strcpy(szName, szFilename);
+		initParams();
+		strcpy(szFilename, szName);
+		pElementCache = NULL;
+		if ( nTemplate && (f = fmemopen(pszTemplate, nTemplate, "r")) != NULL )
+		{
+			getFile(f);
+			fclose(f);
+		}
+	}
+	else
+	{
+		/* Read each changed line again into the entry it set */
+		countTables(anFinal);
+		for ( i = 0; i < nNumVarLines; i++ )
+		{
+			pLine = &pVarLines[i];
+			if ( !lineChanged(pLine->pszText) )
+				continue;
+			setTableCounts(pLine->anBefore);
+			nLineNumber = pLine->nLine - 1;
+			f = fmemopen(pLine->pszText, strlen(pLine->pszText), "r");
+			if ( f != NULL )
+			{
+				getFile(f);
+				fclose(f);
+			}
+			setTableCounts(anFinal);
+		}
+		for ( i = 0; i < nNumVarLines; i++ )
+			if ( pVarLines[i].nTable == TABLE_DIALS && lineChanged(pVarLines[i].pszText) )
+				buildDial(pVarLines[i].nIndex, &pDialGeom[pVarLines[i].nIndex]);
+	}
+
+	/* A variable may name a font the base script does not use */
+	loadFonts();
+
+	f = fopen(pszPath, "w");
+	if ( f == NULL )
+	{
+		perror(pszPath);
+		return 8;
+	}
+	nThreads = 1;
+	i = writeFormat(nFormat, f);
+	if ( fclose(f) || i )
+	{
+		perror(pszPath);
+		return 8;
+	}
+	return 0;
+}
+
+int renderVariants( char *pszVars )
+{
+	FILE *f;
+	char *pszTemplate, **ppszRows, **ppFields, *p;
+	char szPath[sizeof(szFilename) + 16];
+	size_t nTemplate, nSize;
+	int *pnColumnVars;
+	char *pVariant;
+	int anCounts[5];
+	int nColumns, nRows, nMaxRows, nOutput, nFormat, nRunning, nResult, nStatus;
+	int i, j, n;
+	pid_t pid;
+
+	/* The whole CSV, the rows are split as they are used */
+	f = fopen(pszVars, "r");
+	if ( f == NULL )
+	{
+		perror(pszVars);
+		return 8;
+	}
+	ppszRows = NULL;
+	nRows = 0;
+	nMaxRows = 0;
+	for ( ;; )
+	{
+		ppszRows = growTable(ppszRows, &nMaxRows, nRows, 64, sizeof(char *));
+		ppszRows[nRows] = NULL;
+		nSize = 0;
+		if ( getline(&ppszRows[nRows], &nSize, f) < 0 )
+			break;
+		nRows++;
+	}
+	fclose(f);
+	if ( nRows == 0 )
+	{
+		fprintf(stderr, "*** Error, %s is empty ***\n", pszVars);
+		return 1;
+	}
+
+	/* Header, one variable per column */
+	for ( nColumns = 1, p = ppszRows[0]; *p; p++ )
+		if ( *p == ',' )
+			nColumns++;
+	ppFields = malloc(nColumns * sizeof(char *));
+	pnColumnVars = malloc(nColumns * sizeof(int));
+	if ( ppFields == NULL || pnColumnVars == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	nColumns = splitCsv(ppszRows[0], ppFields, nColumns);
+	nOutput = -1;
+	for ( i = 0; i < nColumns; i++ )
+	{
+		p = ppFields[i] + strspn(ppFields[i], " $");
+		p[nameLength(p)] = '\0';
+		pnColumnVars[i] = -1;
+		if ( !strcmp(p, "output") )
+			nOutput = i;
+		else if ( *p == '\0' )
+		{
+			fprintf(stderr, "*** Error, column %d of %s has no variable name ***\n", i + 1, pszVars);
+			return 1;
+		}
+		else
+			pnColumnVars[i] = addVariable(p, strlen(p)) - pVariables;
+	}
+
+	/* Read the script once, keeping the lines that use variables */
+	f = fopen(szFilename, "r");
+	if ( f == NULL )
+	{
+		perror("Opening script file");
+		return 8;
+	}
+	pszTemplate = NULL;
+	nTemplate = 0;
+	nSize = 0;
+	while ( !feof(f) && !ferror(f) )
+	{
+		nSize = nSize ? 2 * nSize : 65536;
+		p = realloc(pszTemplate, nSize);
+		if ( p == NULL )
+		{
+			fprintf(stderr, "*** Error, out of memory. ***\n");
+			exit(8);
+		}
+		pszTemplate = p;
+		nTemplate += fread(pszTemplate + nTemplate, 1, nSize - nTemplate, f);
+	}
+	fclose(f);
+	nRecordVarLines = 1;
+	if ( nTemplate && (f = fmemopen(pszTemplate, nTemplate, "r")) != NULL )
+	{
+		getFile(f);
+		fclose(f);
+	}
+	nRecordVarLines = 0;
+	fprintf(stderr, "%d lines use variables, %d variants\n", nNumVarLines, nRows - 1);
+
+	/* Draw the elements no variable touches */
+	buildGeometry();
+	countTables(anCounts);
+	pVariant = calloc(countElements() + 1, 1);
+	pElementCache = calloc(countElements() + 1, sizeof(FRAGMENT));
+	if ( pVariant == NULL || pElementCache == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		return 8;
+	}
+	for ( i = 0; i < nNumVarLines; i++ )
+		if ( pVarLines[i].nTable >= 0 )
+		{
+			for ( n = pVarLines[i].nIndex, j = 0; j < pVarLines[i].nTable; j++ )
+				n += anCounts[j];
+			pVariant[n] = 1;
+		}
+	for ( i = 0; i < countElements(); i++ )
+		if ( !pVariant[i] )
+		{
+			pFragment = &pElementCache[i];
+			nBytesSaved = 0;
+			emitElement(i);
+			pFragment->nSaved = nBytesSaved;
+			pFragment->nDone = 1;
+			pFragment = NULL;
+		}
+	free(pVariant);
+
+	/* One process per variant */
+	if ( nThreads < 1 )
+		nThreads = 1;
+	nRunning = 0;
+	nResult = 0;
+	for ( i = 1; i < nRows; i++ )
+	{
+		if ( ppszRows[i][strspn(ppszRows[i], " \t\r\n")] == '\0' )
+			continue;
+		n = splitCsv(ppszRows[i], ppFields, nColumns);
+		if ( n != nColumns )
+		{
+			fprintf(stderr, "*** Error, %s line %d has %d fields, the header has %d ***\n", pszVars, i + 1, n, nColumns);
+			nResult = 1;
+			continue;
+		}
+		if ( nOutput >= 0 && ppFields[nOutput][0] != '\0' )
+			snprintf(szPath, sizeof(szPath), "%s", ppFields[nOutput]);
+		else
+		{
+			strcpy(szPath, szFilename);
+			p = strrchr(szPath, '.');
+			if ( p == NULL || strchr(p, '/') != NULL )
+				p = szPath + strlen(szPath);
+			sprintf(p, "-%d.ps", i);
+		}
+		p = strrchr(szPath, '.');
+		nFormat = FORMAT_PS;
+		if ( p != NULL && !strcmp(p, ".svg") )
+			nFormat = FORMAT_SVG;
+		else if ( p != NULL && !strcmp(p, ".pdf") )
+			nFormat = FORMAT_PDF;
+		else if ( p != NULL && !strcmp(p, ".drl") )
+			nFormat = FORMAT_DRILL;
+
+		for ( ; nRunning >= nThreads; nRunning-- )
+			if ( wait(&nStatus) > 0 && (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus)) )
+				nResult = 8;
+		fprintf(stderr, "Variant %d: %s\n", i, szPath);
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if ( pid == 0 )
+			_exit(renderVariant(pszTemplate, nTemplate, pnColumnVars, ppFields, nColumns, szPath, nFormat));
+		if ( pid < 0 )
+		{
+			perror("fork");
+			nResult = 8;
+			continue;
+		}
+		nRunning++;
+	}
+	for ( ; nRunning > 0; nRunning-- )
+		if ( wait(&nStatus) > 0 && (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus)) )
+			nResult = 8;
+
+	for ( i = 0; i < nRows; i++ )
+		free(ppszRows[i]);
+	free(ppszRows);
+	free(ppFields);
+	free(pnColumnVars);
+	free(pszTemplate);
+	return nResult;
+}
+
+/*
+ * Render daemon.
+ *
+ * rcrpanel --serve <socket> listens on a Unix domain socket.  A request is
+ * a 4 byte big-endian length followed by that many bytes: option lines of
+ * the form name=value, an empty line, then the script text.  A response is
+ * a 4 byte big-endian status (0 is success), a 4 byte big-endian length and
+ * then the PostScript, or an error message if the status is not 0.
+ * Requests may be pipelined on a connection; responses always come back in
+ * the order the requests were sent.
+ *
+ * The parent process runs a poll() loop over the listening socket and the
+ * connections and hands complete requests to a pool of pre-forked workers.
+ * The parent never blocks: requests go to the workers and responses to the
+ * clients as their sockets take them.  Each worker renders with the
+ * ordinary global tables, so the only per request cost is initParams() and
+ * the render itself.  On SIGINT or SIGTERM work in hand is finished and
+ * sent, for SHUTDOWNDRAIN seconds at most.
+ */
+#define MAXREQUEST (16 * 1024 * 1024)
+#define MAXREPLY (1024 * 1024 * 1024)   /* Largest response taken from a worker */
+#define MAXWORKERS 64
+#define MAXPENDING 16           /* Requests a connection may have in progress */
+#define MAXUNSENT (16 * 1024 * 1024)    /* Response bytes a connection may leave unread */
+#define SHUTDOWNDRAIN 10        /* Seconds to finish work in hand after a signal */
+
+typedef struct tagJOB
+{
+	unsigned long nConnId;
+	unsigned long nSeq;
+	char *pData;                /* The request frame, length first */
+	size_t nData;
+	struct tagJOB *pNext;
+} JOB;
+
+typedef struct tagRESULT
+{
+	unsigned long nSeq;
+	char *pData;                /* Complete response frame */
+	size_t nData;
+	struct tagRESULT *pNext;
+} RESULT;
+
+typedef struct
+{
+	int fd;
+	unsigned long nConnId;
+	char *pIn;
+	size_t nIn, nInSize;
+	char *pOut;
+	size_t nOut, nOutSize;
+	size_t nOutSent;            /* Of pOut, the rest is still to go */
+	unsigned long nSeqNext;     /* Sequence number of next request */
+	unsigned long nSeqWrite;    /* Sequence number of next response */
+	RESULT *pResults;           /* Responses finished out of order */
+	size_t nResultBytes;        /* Held in pResults */
+	int nEOF;
+} CONNECTION;
+
+typedef struct
+{
+	pid_t pid;
+	int fd;
+	JOB *pJob;                  /* NULL when idle */
+	size_t nSent;               /* Of the request frame */
+	char *pReply;               /* Response read so far */
+	size_t nReply, nReplySize;
+} WORKER;
+
+static volatile sig_atomic_t nShutdown;
+static int fdWake[2];
+
+static void serveSignal( int nSig )
+{
+	(void) nSig;
+	nShutdown = 1;
+	(void) !write(fdWake[1], "", 1);
+}
+
+/* Read or write exactly n bytes on a blocking descriptor */
+static int readFully( int fd, void *p, size_t n )
+{
+	ssize_t r;
+
+	while ( n )
+	{
+		r = read(fd, p, n);
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r <= 0 )
+			return -1;
+		p = (char *) p + r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int writeFully( int fd, const void *p, size_t n )
+{
+	ssize_t r;
+
+	while ( n )
+	{
+		r = write(fd, p, n);
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r <= 0 )
+			return -1;
+		p = (const char *) p + r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* Build a response frame */
+static char *makeResponse( uint32_t nStatus, const char *pData, size_t nData, size_t *pnFrame )
+{
+	char *p;
+	uint32_t nNet;
+
+	p = malloc(8 + nData);
+	if ( p == NULL )
+		return NULL;
+	nNet = htonl(nStatus);
+	memcpy(p, &nNet, 4);
+	nNet = htonl((uint32_t) nData);
+	memcpy(p + 4, &nNet, 4);
+	memcpy(p + 8, pData, nData);
+	*pnFrame = 8 + nData;
+	return p;
+}
+
+/* Render one request in a worker, returning the response frame */
+static char *renderRequest( char *pData, size_t nData, size_t *pnFrame )
+{
+	char *pScript, *pLine, *pEnd, *pValue;
+	char *pOut;
+	size_t nOut, nScript;
+	FILE *f;
+	char szError[256];
+	int nFormat;
+
+	initParams();
+	strcpy(szFilename, "(request)");
+	nFormat = FORMAT_PS;
+	nCompact = 0;
+	fResolution = 2540.0;
+	fTolerance = 0.0;
+	setCompact();
+
+	/* Options, up to the first empty line */
+	pEnd = pData + nData;
+	pLine = pData;
+	for ( ;; )
+	{
+		pScript = memchr(pLine, '\n', pEnd - pLine);
+		if ( pScript == NULL )
+			return makeResponse(1, "missing empty line after options", 32, pnFrame);
+		*pScript++ = '\0';
+		if ( pScript - pLine > 1 && pScript[-2] == '\r' )
+			pScript[-2] = '\0';
+		if ( *pLine == '\0' )
+			break;
+		pValue = strchr(pLine, '=');
+		if ( pValue == NULL )
+			pValue = "";
+		else
+			*pValue++ = '\0';
+		if ( !strcmp("format", pLine) )
+		{
+			nFormat = findFormat(pValue, strlen(pValue));
+			if ( nFormat < 0 || nFormat == FORMAT_GERBER )
+			{
+				snprintf(szError, sizeof(szError), "unsupported format %s", pValue);
+				return makeResponse(1, szError, strlen(szError), pnFrame);
+			}
+		}
+		else if ( !strcmp("compact", pLine) )
+			nCompact = atoi(pValue);
+		else if ( !strcmp("resolution", pLine) && atof(pValue) > 0.0 )
+		{
+			fResolution = atof(pValue);
+			setCompact();
+		}
+		else if ( !strcmp("tolerance", pLine) && atof(pValue) >= 0.0 )
+			fTolerance = atof(pValue);
+		else if ( !strcmp("name", pLine) )
+		{
+			strncpy(szFilename, pValue, sizeof(szFilename) - 1);
+			szFilename[sizeof(szFilename) - 1] = '\0';
+		}
+		else
+		{
+			snprintf(szError, sizeof(szError), "unknown option %s", pLine);
+			return makeResponse(1, szError, strlen(szError), pnFrame);
+		}
+		pLine = pScript;
+	}
+
+	nScript = pEnd - pScript;
+	if ( nScript )
+	{
+		f = fmemopen(pScript, nScript, "r");
+		if ( f == NULL )
+			return makeResponse(2, "cannot open script", 18, pnFrame);
+		getFile(f);
+		fclose(f);
+	}
+
+	pOut = NULL;
+	nOut = 0;
+	fOut = open_memstream(&pOut, &nOut);
+	if ( fOut == NULL )
+	{
+		fOut = stdout;
+		return makeResponse(2, "cannot open output", 18, pnFrame);
+	}
+	f = fOut;
+	writeFormat(nFormat, f);
+	fclose(f);
+	fOut = stdout;
+
+	pData = makeResponse(0, pOut, nOut, pnFrame);
+	free(pOut);
+	return pData;
+}
+
+/* Worker process main loop, runs until the parent closes its end */
+static void serveWorker( int fd )
+{
+	uint32_t nNet;
+	size_t nData, nFrame;
+	char *pData, *pFrame;
+
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	nThreads = 1;               /* The workers are the parallelism here */
+	fLog = fopen("/dev/null", "w");
+	if ( fLog == NULL )
+		fLog = stderr;
+
+	while ( readFully(fd, &nNet, 4) == 0 )
+	{
+		nData = ntohl(nNet);
+		pData = malloc(nData + 1);
+		if ( pData == NULL || readFully(fd, pData, nData) )
+			break;
+		pData[nData] = '\0';
+		pFrame = renderRequest(pData, nData, &nFrame);
+		free(pData);
+		if ( pFrame == NULL || writeFully(fd, pFrame, nFrame) )
+			break;
+		free(pFrame);
+	}
+	_exit(0);
+}
+
+static int nNumConnections;
+static CONNECTION *pConnections[FD_SETSIZE];
+static int nNumWorkers;
+static WORKER wkWorkers[MAXWORKERS];
+static int fdListen;
+
+/* Fork a worker, closing everything in the child that belongs to the parent */
+static int startWorker( WORKER *pWorker )
+{
+	int fd[2];
+	int i;
+
+	if ( socketpair(AF_UNIX, SOCK_STREAM, 0, fd) )
+		return -1;
+	pWorker->pid = fork();
+	if ( pWorker->pid < 0 )
+	{
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+	if ( pWorker->pid == 0 )
+	{
+		close(fd[0]);
+		close(fdListen);
+		close(fdWake[0]);
+		close(fdWake[1]);
+		for ( i = 0; i < nNumWorkers; i++ )
+			if ( &wkWorkers[i] != pWorker && wkWorkers[i].fd >= 0 )
+				close(wkWorkers[i].fd);
+		for ( i = 0; i < nNumConnections; i++ )
+			close(pConnections[i]->fd);
+		serveWorker(fd[1]);
+	}
+	close(fd[1]);
+	pWorker->fd = fd[0];
+	pWorker->pJob = NULL;
+	return 0;
+}
+
+static CONNECTION *findConnection( unsigned long nConnId )
+{
+	int i;
+
+	for ( i = 0; i < nNumConnections; i++ )
+		if ( pConnections[i]->nConnId == nConnId )
+			return pConnections[i];
+	return NULL;
+}
+
+static void appendBytes( char **pp, size_t *pn, size_t *pnSize, const char *p, size_t n )
+{
+	if ( *pn + n > *pnSize )
+	{
+		*pnSize = (*pn + n) * 2;
+		*pp = realloc(*pp, *pnSize);
+		if ( *pp == NULL )
+		{
+			perror("rcrpanel");
+			exit(8);
+		}
+	}
+	memcpy(*pp + *pn, p, n);
+	*pn += n;
+}
+
+/* File a finished response and move everything now in order to the output */
+static void postResult( unsigned long nConnId, unsigned long nSeq, char *pData, size_t nData )
+{
+	CONNECTION *pConn;
+	RESULT *pResult, **ppResult;
+
+	pConn = findConnection(nConnId);
+	if ( pConn == NULL )
+	{
+		free(pData);
+		return;
+	}
+	pResult = malloc(sizeof(RESULT));
+	if ( pResult == NULL || pData == NULL )
+	{
+		perror("rcrpanel");
+		exit(8);
+	}
+	pResult->nSeq = nSeq;
+	pResult->pData = pData;
+	pResult->nData = nData;
+	pResult->pNext = pConn->pResults;
+	pConn->pResults = pResult;
+	pConn->nResultBytes += nData;
+
+	for ( ppResult = &pConn->pResults; *ppResult != NULL; )
+	{
+		pResult = *ppResult;
+		if ( pResult->nSeq == pConn->nSeqWrite )
+		{
+			appendBytes(&pConn->pOut, &pConn->nOut, &pConn->nOutSize, pResult->pData, pResult->nData);
+			pConn->nSeqWrite++;
+			pConn->nResultBytes -= pResult->nData;
+			*ppResult = pResult->pNext;
+			free(pResult->pData);
+			free(pResult);
+			ppResult = &pConn->pResults;    /* Rescan, the next one may be earlier in the list */
+		}
+		else
+			ppResult = &pResult->pNext;
+	}
+}
+
+static void closeConnection( int n )
+{
+	CONNECTION *pConn;
+	RESULT *pResult;
+
+	pConn = pConnections[n];
+	close(pConn->fd);
+	while ( pConn->pResults != NULL )
+	{
+		pResult = pConn->pResults;
+		pConn->pResults = pResult->pNext;
+		free(pResult->pData);
+		free(pResult);
+	}
+	free(pConn->pIn);
+	free(pConn->pOut);
+	free(pConn);
+	pConnections[n] = pConnections[--nNumConnections];
+}
+
+/* True when a connection has as much work in hand as it may */
+static int connectionFull( const CONNECTION *pConn )
+{
+	return pConn->nSeqNext - pConn->nSeqWrite >= MAXPENDING || pConn->nOut - pConn->nOutSent + pConn->nResultBytes >= MAXUNSENT;
+}
+
+/* Split complete frames off the input of a connection into jobs, as many as it may have */
+static void takeRequests( CONNECTION *pConn, JOB ***pppTail )
+{
+	uint32_t nNet;
+	size_t nLen, nUsed;
+	JOB *pJob;
+	char *pFrame;
+	size_t nFrame;
+
+	nUsed = 0;
+	while ( pConn->nIn - nUsed >= 4 && !connectionFull(pConn) )
+	{
+		memcpy(&nNet, pConn->pIn + nUsed, 4);
+		nLen = ntohl(nNet);
+		if ( nLen > MAXREQUEST )
+		{
+			/* Cannot resynchronize, answer and hang up */
+			pFrame = makeResponse(1, "request too large", 17, &nFrame);
+			postResult(pConn->nConnId, pConn->nSeqNext++, pFrame, nFrame);
+			pConn->nEOF = 1;
+			nUsed = pConn->nIn;
+			break;
+		}
+		if ( pConn->nIn - nUsed < 4 + nLen )
+			break;
+		pJob = malloc(sizeof(JOB));
+		if ( pJob == NULL || (pJob->pData = malloc(4 + nLen)) == NULL )
+		{
+			perror("rcrpanel");
+			exit(8);
+		}
+		pJob->nConnId = pConn->nConnId;
+		pJob->nSeq = pConn->nSeqNext++;
+		pJob->nData = 4 + nLen;
+		memcpy(pJob->pData, pConn->pIn + nUsed, 4 + nLen);
+		pJob->pNext = NULL;
+		**pppTail = pJob;
+		*pppTail = &pJob->pNext;
+		nUsed += 4 + nLen;
+	}
+	memmove(pConn->pIn, pConn->pIn + nUsed, pConn->nIn - nUsed);
+	pConn->nIn -= nUsed;
+}
+
+/*
+ * Read what a worker has sent of its response without blocking.  Returns 1
+ * when the response is complete, 0 when there is more to come and -1 if
+ * the worker failed or sent something impossible.
+ */
+static int readReply( WORKER *pWorker )
+{
+	char *p;
+	uint32_t nNet;
+	size_t nWant;
+	ssize_t r;
+
+	for ( ;; )
+	{
+		nWant = 8;
+		if ( pWorker->nReply >= 8 )
+		{
+			memcpy(&nNet, pWorker->pReply + 4, 4);
+			if ( ntohl(nNet) > MAXREPLY )
+				return -1;
+			nWant = 8 + (size_t) ntohl(nNet);
+			if ( pWorker->nReply == nWant )
+				return 1;
+		}
+		if ( nWant > pWorker->nReplySize )
+		{
+			p = realloc(pWorker->pReply, nWant);
+			if ( p == NULL )
+				return -1;
+			pWorker->pReply = p;
+			pWorker->nReplySize = nWant;
+		}
+		r = recv(pWorker->fd, pWorker->pReply + pWorker->nReply, nWant - pWorker->nReply, MSG_DONTWAIT);
+		if ( r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+			return 0;
+		if ( r <= 0 )
+			return -1;
+		pWorker->nReply += r;
+	}
+}
+
+/* Send what the worker will take of its request, returns -1 if it has gone */
+static int sendRequest( WORKER *pWorker )
+{
+	ssize_t r;
+
+	while ( pWorker->nSent < pWorker->pJob->nData )
+	{
+		r = send(pWorker->fd, pWorker->pJob->pData + pWorker->nSent, pWorker->pJob->nData - pWorker->nSent,
+		         MSG_DONTWAIT | MSG_NOSIGNAL);
+		if ( r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+			return 0;
+		if ( r <= 0 )
+			return -1;
+		pWorker->nSent += r;
+	}
+	return 0;
+}
+
+/* Hand a worker's response to its connection, or answer for a worker that failed */
+static void finishJob( WORKER *pWorker, int nFailed )
+{
+	size_t nFrame;
+	char *pFrame;
+	JOB *pJob;
+
+	pJob = pWorker->pJob;
+	pWorker->pJob = NULL;
+	if ( nFailed )
+	{
+		/* Worker died on this one, answer for it and replace the worker */
+		fprintf(stderr, "*** Error, render worker %d failed ***\n", (int) pWorker->pid);
+		close(pWorker->fd);
+		kill(pWorker->pid, SIGKILL);
+		waitpid(pWorker->pid, NULL, 0);
+		pWorker->fd = -1;
+		pFrame = makeResponse(2, "render failed", 13, &nFrame);
+		if ( startWorker(pWorker) )
+		{
+			perror("Starting render worker");
+			nShutdown = 1;
+		}
+	}
+	else
+	{
+		/* The buffer goes with the response, the next one starts afresh */
+		pFrame = pWorker->pReply;
+		nFrame = pWorker->nReply;
+		pWorker->pReply = NULL;
+	}
+	free(pWorker->pReply);
+	pWorker->pReply = NULL;
+	pWorker->nReply = pWorker->nReplySize = 0;
+	postResult(pJob->nConnId, pJob->nSeq, pFrame, nFrame);
+	free(pJob->pData);
+	free(pJob);
+}
+
+/* Run the render daemon on a Unix domain socket until SIGINT or SIGTERM */
+int servePanels( char *pszSocket, int nWorkers )
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	struct pollfd pfd[2 + MAXWORKERS + FD_SETSIZE];
+	int nConnPoll[FD_SETSIZE];
+	JOB *pQueue, **ppTail, *pJob;
+	CONNECTION *pConn;
+	unsigned long nConnIds;
+	time_t tDeadline;
+	char *p;
+	int nPoll, nWorkPoll, nBusy, nTimeout;
+	int fd, i, n;
+	ssize_t r;
+	char cDrain[64];
+
+	if ( nWorkers <= 0 )
+		nWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if ( nWorkers <= 0 )
+		nWorkers = 1;
+	if ( nWorkers > MAXWORKERS )
+		nWorkers = MAXWORKERS;
+
+	if ( strlen(pszSocket) >= sizeof(sun.sun_path) )
+	{
+		fprintf(stderr, "*** Error, socket path %s too long ***\n", pszSocket);
+		return 1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, pszSocket);
+
+	fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( fdListen < 0 )
+	{
+		perror("Creating socket");
+		return 8;
+	}
+	/* Only ever remove an old socket, never some other file given by mistake */
+	if ( lstat(pszSocket, &st) == 0 )
+	{
+		if ( !S_ISSOCK(st.st_mode) )
+		{
+			fprintf(stderr, "*** Error, %s exists and is not a socket ***\n", pszSocket);
+			return 1;
+		}
+		unlink(pszSocket);
+	}
+	if ( bind(fdListen, (struct sockaddr *) &sun, sizeof(sun)) || listen(fdListen, 64) )
+	{
+		perror("Binding socket");
+		return 8;
+	}
+	fcntl(fdListen, F_SETFL, O_NONBLOCK);
 
-	/* Make the circle bolder for larger dials */
-	if ( rcDial[nDialNum].fRadius > 400.0 )
-		addBuffer("gsave 0.677 W ");
+	if ( pipe(fdWake) )
+	{
+		perror("Creating pipe");
+		return 8;
+	}
+	fcntl(fdWake[0], F_SETFL, O_NONBLOCK);
+	fcntl(fdWake[1], F_SETFL, O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, serveSignal);
+	signal(SIGTERM, serveSignal);
+
+	for ( i = 0; i < MAXWORKERS; i++ )
+		wkWorkers[i].fd = -1;
+	for ( nNumWorkers = 0; nNumWorkers < nWorkers; nNumWorkers++ )
+		if ( startWorker(&wkWorkers[nNumWorkers]) )
+		{
+			perror("Starting render worker");
+			return 8;
+		}
+	fprintf(stderr, "Serving on %s with %d workers\n", pszSocket, nNumWorkers);
+
+	pQueue = NULL;
+	ppTail = &pQueue;
+	nConnIds = 0;
+	tDeadline = 0;
+	for ( ;; )
+	{
+		/* Hand queued jobs to idle workers */
+		for ( i = 0; i < nNumWorkers && pQueue != NULL; i++ )
+		{
+			if ( wkWorkers[i].pJob != NULL )
+				continue;
+			pJob = pQueue;
+			pQueue = pJob->pNext;
+			if ( pQueue == NULL )
+				ppTail = &pQueue;
+			if ( findConnection(pJob->nConnId) == NULL )
+			{
+				free(pJob->pData);
+				free(pJob);
+				i--;
+				continue;
+			}
+			wkWorkers[i].pJob = pJob;
+			wkWorkers[i].nSent = 0;
+			if ( sendRequest(&wkWorkers[i]) )
+				finishJob(&wkWorkers[i], 1);
+		}
+
+		/* Queue what connections have room for, and retire those that are finished */
+		for ( i = nNumConnections - 1; i >= 0; i-- )
+		{
+			pConn = pConnections[i];
+			takeRequests(pConn, &ppTail);
+			if ( (pConn->nEOF || nShutdown) && pConn->nSeqWrite == pConn->nSeqNext && pConn->nOut == 0 )
+				closeConnection(i);
+		}
+
+		nBusy = 0;
+		for ( i = 0; i < nNumWorkers; i++ )
+			if ( wkWorkers[i].pJob != NULL )
+				nBusy++;
+		if ( nShutdown && fdListen >= 0 )
+		{
+			close(fdListen);
+			fdListen = -1;
+			unlink(pszSocket);
+			tDeadline = time(NULL) + SHUTDOWNDRAIN;
+		}
+		if ( nShutdown && pQueue == NULL && nBusy == 0 && nNumConnections == 0 )
+			break;
+		nTimeout = -1;
+		if ( nShutdown )
+		{
+			/* Do not wait forever on clients that never read */
+			if ( time(NULL) >= tDeadline )
+			{
+				fprintf(stderr, "*** Error, %d connections still busy at shutdown, closed ***\n", nNumConnections);
+				while ( nNumConnections )
+					closeConnection(nNumConnections - 1);
+				for ( i = 0; i < nNumWorkers; i++ )
+					if ( wkWorkers[i].pJob != NULL )
+						kill(wkWorkers[i].pid, SIGKILL);
+				break;
+			}
+			nTimeout = 1000;
+		}
+
+		/* Build the poll list */
+		nPoll = 0;
+		pfd[nPoll].fd = fdWake[0];
+		pfd[nPoll++].events = POLLIN;
+		if ( fdListen >= 0 && nNumConnections < FD_SETSIZE )
+		{
+			pfd[nPoll].fd = fdListen;
+			pfd[nPoll++].events = POLLIN;
+		}
+		nWorkPoll = nPoll;
+		for ( i = 0; i < nNumWorkers; i++ )
+		{
+			pfd[nPoll].fd = wkWorkers[i].pJob != NULL ? wkWorkers[i].fd : -1;
+			pfd[nPoll].events = POLLIN;
+			if ( wkWorkers[i].pJob != NULL && wkWorkers[i].nSent < wkWorkers[i].pJob->nData )
+				pfd[nPoll].events |= POLLOUT;
+			nPoll++;
+		}
+		for ( i = 0; i < nNumConnections; i++ )
+		{
+			/*
+			 * Stop reading from a connection with its fill of work until its
+			 * client takes some responses.  Once it has hung up only output
+			 * is of interest, and a connection waiting for nothing is left
+			 * out altogether, since POLLHUP would keep poll() from sleeping.
+			 */
+			pConn = pConnections[i];
+			nConnPoll[i] = nPoll;
+			pfd[nPoll].fd = pConn->fd;
+			pfd[nPoll].events = 0;
+			if ( !pConn->nEOF && !nShutdown && !connectionFull(pConn) )
+				pfd[nPoll].events |= POLLIN;
+			if ( pConn->nOut )
+				pfd[nPoll].events |= POLLOUT;
+			if ( pfd[nPoll].events == 0 )
+				pfd[nPoll].fd = -1;
+			nPoll++;
+		}
+
+		if ( poll(pfd, nPoll, nTimeout) < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if ( pfd[0].revents )
+			while ( read(fdWake[0], cDrain, sizeof(cDrain)) > 0 )
+				;
+
+		for ( i = 0; i < nNumWorkers; i++ )
+		{
+			n = pfd[nWorkPoll + i].revents;
+			if ( (n & POLLOUT) && sendRequest(&wkWorkers[i]) )
+				finishJob(&wkWorkers[i], 1);
+			else if ( (n & (POLLIN | POLLHUP | POLLERR)) && (n = readReply(&wkWorkers[i])) != 0 )
+				finishJob(&wkWorkers[i], n < 0);
+		}
+
+		for ( i = nNumConnections - 1; i >= 0; i-- )
+		{
+			pConn = pConnections[i];
+			n = pfd[nConnPoll[i]].revents;
+			if ( n & POLLOUT )
+			{
+				r = write(pConn->fd, pConn->pOut + pConn->nOutSent, pConn->nOut - pConn->nOutSent);
+				if ( r > 0 )
+				{
+					/* Move the rest down only once it is the smaller part, so a big response is not copied per write */
+					pConn->nOutSent += r;
+					if ( pConn->nOutSent == pConn->nOut )
+						pConn->nOut = pConn->nOutSent = 0;
+					else if ( pConn->nOutSent >= pConn->nOut / 2 )
+					{
+						memmove(pConn->pOut, pConn->pOut + pConn->nOutSent, pConn->nOut - pConn->nOutSent);
+						pConn->nOut -= pConn->nOutSent;
+						pConn->nOutSent = 0;
+					}
+				}
+				else if ( r < 0 && errno != EAGAIN && errno != EINTR )
+				{
+					closeConnection(i);
+					continue;
+				}
+			}
+			if ( n & (POLLIN | POLLHUP | POLLERR) && !pConn->nEOF )
+			{
+				if ( pConn->nInSize - pConn->nIn < 65536 )
+				{
+					/* Out of memory only costs this connection */
+					p = realloc(pConn->pIn, pConn->nIn + 65536);
+					if ( p == NULL )
+					{
+						closeConnection(i);
+						continue;
+					}
+					pConn->pIn = p;
+					pConn->nInSize = pConn->nIn + 65536;
+				}
+				r = read(pConn->fd, pConn->pIn + pConn->nIn, pConn->nInSize - pConn->nIn);
+				if ( r > 0 )
+				{
+					pConn->nIn += r;
+					takeRequests(pConn, &ppTail);
+				}
+				else if ( r == 0 )
+					pConn->nEOF = 1;
+				else if ( errno != EAGAIN && errno != EINTR )
+				{
+					closeConnection(i);
+					continue;
+				}
+			}
+		}
+
+		/* Accept new connections */
+		if ( fdListen >= 0 && pfd[1].fd == fdListen && pfd[1].revents )
+		{
+			while ( nNumConnections < FD_SETSIZE && (fd = accept(fdListen, NULL, NULL)) >= 0 )
+			{
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				pConn = calloc(1, sizeof(CONNECTION));
+				if ( pConn == NULL )
+				{
+					close(fd);
+					break;
+				}
+				pConn->fd = fd;
+				pConn->nConnId = ++nConnIds;
+				pConnections[nNumConnections++] = pConn;
+			}
+		}
+	}
+
+	/* Workers exit when they see their socket close */
+	for ( i = 0; i < nNumWorkers; i++ )
+		close(wkWorkers[i].fd);
+	for ( i = 0; i < nNumWorkers; i++ )
+		waitpid(wkWorkers[i].pid, NULL, 0);
+	fprintf(stderr, "Server on %s shut down\n", pszSocket);
+	return 0;
+}
+
+/*
+ * Design rule check.
+ *
+ * --check looks for holes and cutouts that overlap or are closer than the
+ * clearance, features outside the panel or too near its edge, holes that
+ * land on a dial scale and labels drawn through holes, cutouts or each
+ * other.  A hole or cutout lying wholly inside a cutout is fine, it only
+ * goes through material that is already gone.  Every feature is reduced
+ * to a circle, ring or box and dropped into a uniform grid sized to the
+ * feature count.  Only features sharing a cell are compared, and each pair
+ * only in the cell holding the corner of their common area, so the work
+ * follows the number of neighbours rather than all pairs.
+ */
+#define DRC_HOLE 0
+#define DRC_CUTOUT 1
+#define DRC_DIAL 2
+#define DRC_LABEL 3
+
+typedef struct
+{
+	int nKind;
+	int nLine;
+	double x, y;                /* Center of holes and dials */
+	double r, rIn;              /* Radius, inner radius of a dial scale */
+	double x0, y0, x1, y1;      /* Bounding box */
+} DRCFEATURE;
+
+typedef struct
+{
+	int nLine;
+	int nOtherLine;
+	char szMessage[96];
+} DRCVIOLATION;
+
+static DRCVIOLATION *pViolations;
+static int nNumViolations, nMaxViolations;
+
+static void addViolation( int nLine, int nOtherLine, const char *pszMessage )
+{
+	pViolations = growTable(pViolations, &nMaxViolations, nNumViolations, 64, sizeof(DRCVIOLATION));
+	pViolations[nNumViolations].nLine = nLine;
+	pViolations[nNumViolations].nOtherLine = nOtherLine;
+	strncpy(pViolations[nNumViolations].szMessage, pszMessage, sizeof(pViolations[0].szMessage) - 1);
+	nNumViolations++;
+}
+
+static int compareViolations( const void *a, const void *b )
+{
+	const DRCVIOLATION *p = a, *q = b;
+
+	if ( p->nLine != q->nLine )
+		return p->nLine - q->nLine;
+	if ( p->nOtherLine != q->nOtherLine )
+		return p->nOtherLine - q->nOtherLine;
+	return strcmp(p->szMessage, q->szMessage);
+}
+
+/* Distance from a point to a box, 0 inside */
+static double boxDistance( const DRCFEATURE *p, double x, double y )
+{
+	double dx, dy;
+
+	dx = x < p->x0 ? p->x0 - x : (x > p->x1 ? x - p->x1 : 0.0);
+	dy = y < p->y0 ? p->y0 - y : (y > p->y1 ? y - p->y1 : 0.0);
+	return sqrt(dx * dx + dy * dy);
+}
+
+/* Distance from a point to the farthest corner of a box */
+static double boxFarthest( const DRCFEATURE *p, double x, double y )
+{
+	double dx, dy;
+
+	dx = fmax(fabs(x - p->x0), fabs(x - p->x1));
+	dy = fmax(fabs(y - p->y0), fabs(y - p->y1));
+	return sqrt(dx * dx + dy * dy);
+}
+
+/* Whether box a lies wholly inside box b */
+static int boxInside( const DRCFEATURE *a, const DRCFEATURE *b )
+{
+	return a->x0 >= b->x0 && a->y0 >= b->y0 && a->x1 <= b->x1 && a->y1 <= b->y1;
+}
+
+/* Gap between two boxes, negative when they overlap */
+static double boxGap( const DRCFEATURE *a, const DRCFEATURE *b )
+{
+	double dx, dy;
+
+	dx = fmax(a->x0 - b->x1, b->x0 - a->x1);
+	dy = fmax(a->y0 - b->y1, b->y0 - a->y1);
+	if ( dx < 0.0 && dy < 0.0 )
+		return fmax(dx, dy);
+	dx = fmax(dx, 0.0);
+	dy = fmax(dy, 0.0);
+	return sqrt(dx * dx + dy * dy);
+}
+
+static const char *szDrcNames[] = { "hole", "rectangle", "dial scale", "label" };
+
+/* Check one pair of features, a is always the lower kind */
+static void checkPair( const DRCFEATURE *a, const DRCFEATURE *b, double fClearance )
+{
+	char szWork[96];
+	double d, fGap;
+
+	fGap = HUGE_VAL;
+	switch ( a->nKind * 4 + b->nKind )
+	{
+	case DRC_HOLE * 4 + DRC_HOLE:
+		fGap = hypot(a->x - b->x, a->y - b->y) - a->r - b->r;
+		break;
+	case DRC_HOLE * 4 + DRC_CUTOUT:
+		/* A hole wholly inside a cutout, such as a button in its recess, goes through nothing */
+		if ( boxInside(a, b) )
+			return;
+		fGap = boxDistance(b, a->x, a->y) - a->r;
+		break;
+	case DRC_CUTOUT * 4 + DRC_CUTOUT:
+		if ( boxInside(a, b) || boxInside(b, a) )
+			return;
+		fGap = boxGap(a, b);
+		break;
+	case DRC_HOLE * 4 + DRC_DIAL:
+		d = hypot(a->x - b->x, a->y - b->y);
+		if ( d + a->r > b->rIn && d - a->r < b->r )
+		{
+			sprintf(szWork, "%.2f mm hole lands on the dial scale", 2.0 * a->r);
+			addViolation(a->nLine, b->nLine, szWork);
+		}
+		return;
+	case DRC_CUTOUT * 4 + DRC_DIAL:
+		if ( boxDistance(a, b->x, b->y) < b->r && boxFarthest(a, b->x, b->y) > b->rIn )
+			addViolation(a->nLine, b->nLine, "rectangle lands on the dial scale");
+		return;
+	case DRC_DIAL * 4 + DRC_DIAL:
+		if ( hypot(a->x - b->x, a->y - b->y) < a->r + b->r )
+			addViolation(a->nLine, b->nLine, "dial scales overlap");
+		return;
+	case DRC_HOLE * 4 + DRC_LABEL:
+		if ( boxDistance(b, a->x, a->y) < a->r )
+			addViolation(b->nLine, a->nLine, "label is drawn through a hole");
+		return;
+	case DRC_CUTOUT * 4 + DRC_LABEL:
+		if ( boxGap(a, b) < 0.0 )
+			addViolation(b->nLine, a->nLine, "label is drawn through a rectangle");
+		return;
+	case DRC_LABEL * 4 + DRC_LABEL:
+		if ( boxGap(a, b) < 0.0 )
+			addViolation(a->nLine, b->nLine, "labels overlap");
+		return;
+	default:
+		return;
+	}
+
+	/* Holes and cutouts */
+	if ( fGap < 0.0 )
+		sprintf(szWork, "%s overlaps %s", szDrcNames[a->nKind], szDrcNames[b->nKind]);
+	else if ( fGap < fClearance )
+		sprintf(szWork, "%s is %.2f mm from %s", szDrcNames[a->nKind], fGap, szDrcNames[b->nKind]);
 	else
-		addBuffer("gsave 0.339 W ");
+		return;
+	addViolation(a->nLine, b->nLine, szWork);
+}
 
-	addColor(rcDial[nDialNum].crCircle);
+/* Check a feature against the panel outline */
+static void checkBounds( const DRCFEATURE *p, double fClearance )
+{
+	char szWork[96];
+	double fEdge;
+
+	if ( p->x0 < 0.0 || p->y0 < 0.0 || p->x1 > fPanelWidth || p->y1 > fPanelHeight )
+	{
+		sprintf(szWork, "%s extends outside the panel", szDrcNames[p->nKind]);
+		addViolation(p->nLine, 0, szWork);
+		return;
+	}
+	if ( p->nKind != DRC_HOLE && p->nKind != DRC_CUTOUT )
+		return;
+	fEdge = fmin(fmin(p->x0, p->y0), fmin(fPanelWidth - p->x1, fPanelHeight - p->y1));
+	if ( fEdge < fClearance )
+	{
+		sprintf(szWork, "%s is %.2f mm from the panel edge", szDrcNames[p->nKind], fEdge);
+		addViolation(p->nLine, 0, szWork);
+	}
+}
+
+/* Grid column or row of a coordinate, clamped before it becomes an int */
+static int cellIndex( double v, double fMin, double fCell, int nCount )
+{
+	v = floor((v - fMin) / fCell);
+	if ( !(v >= 0.0) )
+		return 0;               /* Also NaN */
+	if ( v > nCount - 1 )
+		return nCount - 1;
+	return (int) v;
+}
+
+/* The grid cells covered by a feature, padded by half the clearance */
+static void cellRange( const DRCFEATURE *p, double fMinX, double fMinY, double fCell, double fPad,
+                       int nCols, int nRows, int *pcx0, int *pcy0, int *pcx1, int *pcy1 )
+{
+	*pcx0 = cellIndex(p->x0 - fPad, fMinX, fCell, nCols);
+	*pcy0 = cellIndex(p->y0 - fPad, fMinY, fCell, nRows);
+	*pcx1 = cellIndex(p->x1 + fPad, fMinX, fCell, nCols);
+	*pcy1 = cellIndex(p->y1 + fPad, fMinY, fCell, nRows);
+}
+
+/* Run the design rule check, returns the number of violations */
+int checkPanel( double fClearance )
+{
+	DRCFEATURE *pFeatures, *a, *b;
+	int nFeatures, nMax;
+	int *pnCellStart, *pnCellItems, *pnCursor;
+	int nCols, nRows, nCells, nCell;
+	double fMinX, fMinY, fMaxX, fMaxY, fCell, fPad;
+	int i, j, cx, cy, cx0, cy0, cx1, cy1;
+
+	/* Gather everything as simple shapes */
+	nMax = nNumControls + nNumRectangles + nNumCtrRectangles + nNumDials + nNumStrings;
+	pFeatures = malloc((nMax ? nMax : 1) * sizeof(DRCFEATURE));
+	if ( pFeatures == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		return -1;
+	}
+	nFeatures = 0;
+	for ( i = 0; i < nNumControls; i++ )
+	{
+		a = &pFeatures[nFeatures++];
+		a->nKind = DRC_HOLE;
+		a->nLine = rcControl[i].nLine;
+		a->x = rcControl[i].x;
+		a->y = rcControl[i].y;
+		a->r = rcControl[i].diam / 2.0;
+		a->x0 = a->x - a->r;
+		a->y0 = a->y - a->r;
+		a->x1 = a->x + a->r;
+		a->y1 = a->y + a->r;
+	}
+	for ( i = 0; i < nNumRectangles; i++ )
+	{
+		a = &pFeatures[nFeatures++];
+		a->nKind = DRC_CUTOUT;
+		a->nLine = rcRectangle[i].nLine;
+		a->x0 = fmin(rcRectangle[i].x0, rcRectangle[i].x0 + rcRectangle[i].fRectangleWidth);
+		a->x1 = fmax(rcRectangle[i].x0, rcRectangle[i].x0 + rcRectangle[i].fRectangleWidth);
+		a->y0 = fmin(rcRectangle[i].y0, rcRectangle[i].y0 + rcRectangle[i].fRectangleHeight);
+		a->y1 = fmax(rcRectangle[i].y0, rcRectangle[i].y0 + rcRectangle[i].fRectangleHeight);
+	}
+	for ( i = 0; i < nNumCtrRectangles; i++ )
+	{
+		a = &pFeatures[nFeatures++];
+		a->nKind = DRC_CUTOUT;
+		a->nLine = rcRectCenter[i].nLine;
+		a->x0 = rcRectCenter[i].x - fabs(rcRectCenter[i].fRectangleWidth) / 2.0;
+		a->x1 = rcRectCenter[i].x + fabs(rcRectCenter[i].fRectangleWidth) / 2.0;
+		a->y0 = rcRectCenter[i].y - fabs(rcRectCenter[i].fRectangleHeight) / 2.0;
+		a->y1 = rcRectCenter[i].y + fabs(rcRectCenter[i].fRectangleHeight) / 2.0;
+	}
+	for ( i = 0; i < nNumDials; i++ )
+	{
+		a = &pFeatures[nFeatures++];
+		a->nKind = DRC_DIAL;
+		a->nLine = rcDial[i].nLine;
+		a->x = rcDial[i].x0;
+		a->y = rcDial[i].y0;
+		a->rIn = rcDial[i].fRadius;
+		a->r = rcDial[i].fRadius + rcDial[i].fSizeBig + rcDial[i].fSizeFont;
+		a->x0 = a->x - a->r;
+		a->y0 = a->y - a->r;
+		a->x1 = a->x + a->r;
+		a->y1 = a->y + a->r;
+	}
+	loadFonts();
+	for ( i = 0; i < nNumStrings; i++ )
+	{
+		a = &pFeatures[nFeatures++];
+		a->nKind = DRC_LABEL;
+		a->nLine = rcText[i].nLine;
+		textExtent(i, &a->x0, &a->y0, &a->x1, &a->y1);
+	}
 
-	x0 = rcDial[nDialNum].x0;
-	y0 = rcDial[nDialNum].y0;
+	nNumViolations = 0;
+	for ( i = 0; i < nFeatures; i++ )
+		checkBounds(&pFeatures[i], fClearance);
 
-	theta0 = 90.0 + (360.0 - rcDial[nDialNum].fSpan) / 2.0 + rcDial[nDialNum].fStartAngle; /* Starting angle */
+	/* Size the grid for a handful of features per cell */
+	fPad = fClearance / 2.0;
+	fMinX = fMinY = 0.0;
+	fMaxX = fPanelWidth;
+	fMaxY = fPanelHeight;
+	for ( i = 0; i < nFeatures; i++ )
+	{
+		/* Absurd coordinates just land in the edge cells */
+		if ( !isfinite(pFeatures[i].x0) || !isfinite(pFeatures[i].y0) || !isfinite(pFeatures[i].x1) || !isfinite(pFeatures[i].y1) )
+			continue;
+		fMinX = fmin(fMinX, pFeatures[i].x0 - fPad);
+		fMinY = fmin(fMinY, pFeatures[i].y0 - fPad);
+		fMaxX = fmax(fMaxX, pFeatures[i].x1 + fPad);
+		fMaxY = fmax(fMaxY, pFeatures[i].y1 + fPad);
+	}
+	fMinX = fmax(fMinX, -1e12);
+	fMinY = fmax(fMinY, -1e12);
+	fMaxX = fmin(fMaxX, 1e12);
+	fMaxY = fmin(fMaxY, 1e12);
+	fCell = sqrt((fMaxX - fMinX) * (fMaxY - fMinY) / (nFeatures + 1));
+	if ( fCell < 1.0 )
+		fCell = 1.0;
+	while ( (floor((fMaxX - fMinX) / fCell) + 1.0) * (floor((fMaxY - fMinY) / fCell) + 1.0) > 4.0 * nFeatures + 1024.0 )
+		fCell *= 1.5;
+	nCols = (int) ((fMaxX - fMinX) / fCell) + 1;
+	nRows = (int) ((fMaxY - fMinY) / fCell) + 1;
+	nCells = nCols * nRows;
 
-	for ( i = 0; i < 1000; i++ )       /* Will draw circle in 1000 segments */
+	/* Bucket the features by counting sort */
+	pnCellStart = calloc(nCells + 1, sizeof(int));
+	pnCursor = malloc(nCells * sizeof(int));
+	if ( pnCellStart == NULL || pnCursor == NULL )
 	{
-		theta = 3.14159268 * (theta0 + ((double) i) * rcDial[nDialNum].fSpan / 999.0) / 180.0;
-		x = x0 + rcDial[nDialNum].fRadius * cos( theta );
-		y = y0 - rcDial[nDialNum].fRadius * sin( theta );
-		if ( i )
-			addLine(x, y);
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	for ( i = 0; i < nFeatures; i++ )
+	{
+		cellRange(&pFeatures[i], fMinX, fMinY, fCell, fPad, nCols, nRows, &cx0, &cy0, &cx1, &cy1);
+		for ( cy = cy0; cy <= cy1; cy++ )
+			for ( cx = cx0; cx <= cx1; cx++ )
+				pnCellStart[cy * nCols + cx + 1]++;
+	}
+	for ( nCell = 0; nCell < nCells; nCell++ )
+		pnCellStart[nCell + 1] += pnCellStart[nCell];
+	pnCellItems = malloc((pnCellStart[nCells] + 1) * sizeof(int));
+	if ( pnCellItems == NULL )
+	{
+		fprintf(stderr, "*** Error, out of memory. ***\n");
+		exit(8);
+	}
+	memcpy(pnCursor, pnCellStart, nCells * sizeof(int));
+	for ( i = 0; i < nFeatures; i++ )
+	{
+		cellRange(&pFeatures[i], fMinX, fMinY, fCell, fPad, nCols, nRows, &cx0, &cy0, &cx1, &cy1);
+		for ( cy = cy0; cy <= cy1; cy++ )
+			for ( cx = cx0; cx <= cx1; cx++ )
+				pnCellItems[pnCursor[cy * nCols + cx]++] = i;
+	}
+
+	/* Compare within each cell */
+	for ( nCell = 0; nCell < nCells; nCell++ )
+	{
+		cx = nCell % nCols;
+		cy = nCell / nCols;
+		for ( i = pnCellStart[nCell]; i < pnCellStart[nCell + 1]; i++ )
+			for ( j = i + 1; j < pnCellStart[nCell + 1]; j++ )
+			{
+				a = &pFeatures[pnCellItems[i]];
+				b = &pFeatures[pnCellItems[j]];
+				/* Only in the cell holding the low corner of the shared area */
+				cx0 = cellIndex(fmax(a->x0, b->x0) - fPad, fMinX, fCell, nCols);
+				cy0 = cellIndex(fmax(a->y0, b->y0) - fPad, fMinY, fCell, nRows);
+				if ( cx0 != cx || cy0 != cy )
+					continue;
+				if ( a->nKind <= b->nKind )
+					checkPair(a, b, fClearance);
+				else
+					checkPair(b, a, fClearance);
+			}
+	}
+	free(pnCellStart);
+	free(pnCursor);
+	free(pnCellItems);
+	free(pFeatures);
+
+	qsort(pViolations, nNumViolations, sizeof(DRCVIOLATION), compareViolations);
+	for ( i = 0; i < nNumViolations; i++ )
+	{
+		if ( pViolations[i].nOtherLine )
+			fprintf(stderr, "*** Line %d: %s (line %d) ***\n", pViolations[i].nLine,
+			        pViolations[i].szMessage, pViolations[i].nOtherLine);
 		else
-			addMove(x, y);
+			fprintf(stderr, "*** Line %d: %s ***\n", pViolations[i].nLine, pViolations[i].szMessage);
 	}
-	addBuffer("S grestore ");
+	fprintf(stderr, "%d design rule violation%s\n", nNumViolations, nNumViolations == 1 ? "" : "s");
+	return nNumViolations;
+}
 
-	/* Draw ticks and annotation */
+/*
+ * Asynchronous output.  When the standard output is a pipe, fOut becomes a
+ * stream that copies into a ring of large buffers, and a writer thread
+ * drains the full ones.  The renderer only waits when the whole ring is
+ * full, so a slow spooler or gzip on the other end no longer stalls every
+ * line.  The writer hands each run of full buffers to the pipe in a single
+ * writev().  Anything other than a pipe keeps the ordinary blocking stdio
+ * path.
+ */
+#define RINGBUFFERS 4
+#define RINGBUFSIZE (1024 * 1024)
 
-	if ( rcDial[nDialNum].fSizeTicks > 20.0 )           /* Use a heavier line if ticks are long */
-		addBuffer("gsave 0.339 W ");
-	else
-		addBuffer("gsave 0.169 W ");
-	addColor(rcDial[nDialNum].crTickMarks);             /* Color of small tick marks */
-	setFormat( nDialNum, szFormat );             /* Calculate format for numbers */
+#define RING_FREE 0
+#define RING_FILLING 1
+#define RING_FULL 2
 
-	/* Set up the font of the right size */
-	sprintf(szWork, "%6.2f ", rcDial[nDialNum].fSizeFont);
-	p = szWork;
-	while ( *p == ' ')
-		p++;
-	addBuffer(p);
-	addBuffer("/Helvetica-Bold ");
-	addBuffer("F ");
+static struct
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int fd;
+	char *pBuf[RINGBUFFERS];
+	size_t nLen[RINGBUFFERS];
+	int nState[RINGBUFFERS];
+	int nFill;                  /* Buffer the renderer is filling */
+	int nWrite;                 /* Next buffer for the writer */
+	int nClosing;
+	int nError;
+} awRing;
+
+/* Push out a run of full buffers in one call, returns 0 or -1 */
+static int writeRun( struct iovec *pIov, int nIov )
+{
+	ssize_t r;
+	int i;
+
+	while ( nIov )
+	{
+		r = writev(awRing.fd, pIov, nIov);
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r <= 0 )
+			return -1;
+		for ( i = 0; i < nIov && (size_t) r >= pIov[i].iov_len; i++ )
+			r -= pIov[i].iov_len;
+		pIov += i;
+		nIov -= i;
+		if ( nIov )
+		{
+			pIov->iov_base = (char *) pIov->iov_base + r;
+			pIov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+static void *writerThread( void *pArg )
+{
+	struct iovec iov[RINGBUFFERS];
+	int nRun, nFirst, nError, i;
+
+	(void) pArg;
+	pthread_mutex_lock(&awRing.mtx);
+	for ( ;; )
+	{
+		if ( awRing.nState[awRing.nWrite] != RING_FULL )
+		{
+			if ( awRing.nClosing )
+				break;
+			pthread_cond_wait(&awRing.cond, &awRing.mtx);
+			continue;
+		}
+
+		/* Gather every full buffer in ring order */
+		nFirst = awRing.nWrite;
+		for ( nRun = 0; nRun < RINGBUFFERS && awRing.nState[(nFirst + nRun) % RINGBUFFERS] == RING_FULL; nRun++ )
+		{
+			iov[nRun].iov_base = awRing.pBuf[(nFirst + nRun) % RINGBUFFERS];
+			iov[nRun].iov_len = awRing.nLen[(nFirst + nRun) % RINGBUFFERS];
+		}
+		nError = awRing.nError;
+		pthread_mutex_unlock(&awRing.mtx);
+
+		/* After an error the rest is dropped, the renderer sees it on its next write */
+		if ( !nError && writeRun(iov, nRun) )
+			nError = errno ? errno : EIO;
+
+		pthread_mutex_lock(&awRing.mtx);
+		awRing.nError = nError;
+		for ( i = 0; i < nRun; i++ )
+		{
+			awRing.nState[(nFirst + i) % RINGBUFFERS] = RING_FREE;
+			awRing.nLen[(nFirst + i) % RINGBUFFERS] = 0;
+		}
+		awRing.nWrite = (nFirst + nRun) % RINGBUFFERS;
+		pthread_cond_broadcast(&awRing.cond);
+	}
+	pthread_mutex_unlock(&awRing.mtx);
+	return NULL;
+}
+
+/* Hand the buffer being filled to the writer and wait for the next one */
+static void passBuffer( void )
+{
+	pthread_mutex_lock(&awRing.mtx);
+	awRing.nState[awRing.nFill] = RING_FULL;
+	awRing.nFill = (awRing.nFill + 1) % RINGBUFFERS;
+	pthread_cond_broadcast(&awRing.cond);
+	while ( awRing.nState[awRing.nFill] != RING_FREE )
+		pthread_cond_wait(&awRing.cond, &awRing.mtx);
+	awRing.nState[awRing.nFill] = RING_FILLING;
+	pthread_mutex_unlock(&awRing.mtx);
+}
+
+static ssize_t ringWrite( void *pCookie, const char *p, size_t n )
+{
+	size_t nLeft, nCopy;
+	int nFill, nError;
+
+	(void) pCookie;
+	pthread_mutex_lock(&awRing.mtx);
+	nError = awRing.nError;
+	pthread_mutex_unlock(&awRing.mtx);
+	if ( nError )
+	{
+		errno = nError;
+		return -1;
+	}
+	for ( nLeft = n; nLeft; nLeft -= nCopy, p += nCopy )
+	{
+		nFill = awRing.nFill;
+		nCopy = RINGBUFSIZE - awRing.nLen[nFill];
+		if ( nCopy > nLeft )
+			nCopy = nLeft;
+		memcpy(awRing.pBuf[nFill] + awRing.nLen[nFill], p, nCopy);
+		awRing.nLen[nFill] += nCopy;
+		if ( awRing.nLen[nFill] == RINGBUFSIZE )
+			passBuffer();
+	}
+	return n;
+}
+
+static int ringClose( void *pCookie )
+{
+	int i;
+
+	(void) pCookie;
+	pthread_mutex_lock(&awRing.mtx);
+	if ( awRing.nLen[awRing.nFill] )
+		awRing.nState[awRing.nFill] = RING_FULL;
+	awRing.nClosing = 1;
+	pthread_cond_broadcast(&awRing.cond);
+	pthread_mutex_unlock(&awRing.mtx);
+	pthread_join(awRing.thread, NULL);
+
+	for ( i = 0; i < RINGBUFFERS; i++ )
+		free(awRing.pBuf[i]);
+	pthread_cond_destroy(&awRing.cond);
+	pthread_mutex_destroy(&awRing.mtx);
+	if ( awRing.nError )
+	{
+		errno = awRing.nError;
+		return EOF;
+	}
+	return 0;
+}
+
+/* Open an asynchronous stream on fd if it is a pipe, otherwise NULL */
+FILE *openAsyncOutput( int fd )
+{
+#ifdef HAVE_FOPENCOOKIE
+	cookie_io_functions_t io = { NULL, ringWrite, NULL, ringClose };
+	struct stat st;
+	FILE *f;
+	int i;
+
+	if ( fstat(fd, &st) || !S_ISFIFO(st.st_mode) )
+		return NULL;
+	memset(&awRing, 0, sizeof(awRing));
+	awRing.fd = fd;
+	for ( i = 0; i < RINGBUFFERS; i++ )
+		if ( (awRing.pBuf[i] = malloc(RINGBUFSIZE)) == NULL )
+		{
+			while ( i-- )
+				free(awRing.pBuf[i]);
+			return NULL;
+		}
+	awRing.nState[0] = RING_FILLING;
+	pthread_mutex_init(&awRing.mtx, NULL);
+	pthread_cond_init(&awRing.cond, NULL);
+	if ( pthread_create(&awRing.thread, NULL, writerThread, NULL) )
+	{
+		for ( i = 0; i < RINGBUFFERS; i++ )
+			free(awRing.pBuf[i]);
+		return NULL;
+	}
+	f = fopencookie(NULL, "w", io);
+	if ( f == NULL )
+	{
+		awRing.nClosing = 1;
+		pthread_cond_broadcast(&awRing.cond);
+		pthread_join(awRing.thread, NULL);
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, 65536);
+	return f;
+#else
+	(void) fd;
+	return NULL;
+#endif
+}
+
+/*
+ * Output cache.
+ *
+ * With --cache=<dir> the parsed tables, the render options and the program
+ * revision and build time are hashed and the PostScript is kept in
+ * <dir>/<sha256>.ps.  The output depends on nothing else, so a hit is
+ * streamed straight from the file without rendering.  A miss is rendered
+ * to a temporary file and renamed into place, then the oldest entries are
+ * removed until the directory is within --cache-size, along with temporary
+ * files left by renders that were interrupted.  Use time is kept in the
+ * modification time, which is touched on every hit.
+ */
+#define CACHESIZE (256LL * 1024 * 1024)
+#define CACHETEMPAGE 600        /* Seconds before a leftover temporary file is removed */
+
+typedef struct
+{
+	uint32_t h[8];
+	uint64_t nBytes;
+	unsigned char buf[64];
+	size_t nBuf;
+} SHA256CTX;
+
+static const uint32_t k256[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block( SHA256CTX *pCtx, const unsigned char *p )
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for ( i = 0; i < 16; i++ )
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+	for ( ; i < 64; i++ )
+		w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3))
+		       + w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	a = pCtx->h[0]; b = pCtx->h[1]; c = pCtx->h[2]; d = pCtx->h[3];
+	e = pCtx->h[4]; f = pCtx->h[5]; g = pCtx->h[6]; h = pCtx->h[7];
+	for ( i = 0; i < 64; i++ )
+	{
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	pCtx->h[0] += a; pCtx->h[1] += b; pCtx->h[2] += c; pCtx->h[3] += d;
+	pCtx->h[4] += e; pCtx->h[5] += f; pCtx->h[6] += g; pCtx->h[7] += h;
+}
 
-	/* Loop through all the ticks */
-	nBig = 0;
-	for ( i = 0; i < rcDial[nDialNum].nNumTicks; i++ )
-	{
-		double nn = rcDial[nDialNum].nNumTicks - 1;
-		theta = 3.14159268 * (theta0 + ((double) i) * rcDial[nDialNum].fSpan / nn) / 180.0;
-		x = x0 + rcDial[nDialNum].fRadius * cos( theta );
-		y = y0 - rcDial[nDialNum].fRadius * sin( theta );
-		addMove(x, y);
-
-		if ( i % rcDial[nDialNum].nBigPer )             /* Is it a big one? */
-		{	/* No */
-			x = x0 + (rcDial[nDialNum].fRadius + rcDial[nDialNum].fSizeTicks) * cos( theta );
-			y = y0 - (rcDial[nDialNum].fRadius + rcDial[nDialNum].fSizeTicks) * sin( theta );
-			addLine(x, y);
-			addBuffer("S ");
-		}
-		else
-		{	/* Yes */
-			addColor(rcDial[nDialNum].crBigTickMarks);
-			x = x0 + (rcDial[nDialNum].fRadius + rcDial[nDialNum].fSizeBig) * cos( theta );
-			y = y0 - (rcDial[nDialNum].fRadius + rcDial[nDialNum].fSizeBig) * sin( theta );
-			addLine(x, y);
-			addBuffer("S ");
+static void sha256Init( SHA256CTX *pCtx )
+{
+	static const uint32_t h0[8] =
+	{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
 
-			/* Now need to annotate the big tick mark */
-			fCurrentIndication = rcDial[nDialNum].fStartingIndicator
-			                     + nBig * rcDial[nDialNum].fIncrementPerBigTick;
-			nBig++;
-			sprintf(szIndicate, szFormat, fCurrentIndication);
+	memcpy(pCtx->h, h0, sizeof(h0));
+	pCtx->nBytes = 0;
+	pCtx->nBuf = 0;
+}
 
-			addColor(rcDial[nDialNum].crText);          /* Set text color */
-			addMove(x, y);
-			sprintf(szWork, "(%s) ", szIndicate);
-			addBuffer(szWork);
-			/* If the tick is near the top, center text over tick */
-			if ( fabs(theta - fTop) < fDelta )
-				addBuffer("TC ");
-			/* otherwise if the tick is on the left, start left of the tick */
-			else if ( theta < fTop )
-				addBuffer("TR ");
-			/* Otherwise start at the tick */
-			else
-				addBuffer("T ");
-			/* Reset to small tick color */
-			addColor(rcDial[nDialNum].crTickMarks);
+static void sha256Update( SHA256CTX *pCtx, const void *pData, size_t n )
+{
+	const unsigned char *p = pData;
+
+	pCtx->nBytes += n;
+	while ( n-- )
+	{
+		pCtx->buf[pCtx->nBuf++] = *p++;
+		if ( pCtx->nBuf == 64 )
+		{
+			sha256Block(pCtx, pCtx->buf);
+			pCtx->nBuf = 0;
 		}
 	}
+}
 
-	/* Finally, place a drilling crosshair */
-	addColor(0);
-	addMove(x0 - 4, y0);
-	addLine(x0 + 4, y0);
-	addBuffer("S ");
-	addMove(x0, y0 - 4);
-	addLine(x0, y0 + 4);
-	addBuffer("S ");
+static void sha256Final( SHA256CTX *pCtx, char *szHex )
+{
+	uint64_t nBits;
+	unsigned char c;
+	int i;
 
-	addBuffer("grestore ");
+	nBits = pCtx->nBytes * 8;
+	c = 0x80;
+	sha256Update(pCtx, &c, 1);
+	c = 0;
+	while ( pCtx->nBuf != 56 )
+		sha256Update(pCtx, &c, 1);
+	for ( i = 7; i >= 0; i-- )
+	{
+		c = (unsigned char) (nBits >> (8 * i));
+		sha256Update(pCtx, &c, 1);
+	}
+	for ( i = 0; i < 8; i++ )
+		sprintf(&szHex[8 * i], "%08x", pCtx->h[i]);
 }
 
-void addRectangle( double x0, double y0, double width, double height )
+/*
+ * Feed table values in a fixed layout, independent of struct padding and
+ * of byte order, so that machines sharing a cache agree on the keys.
+ */
+static void hash64( SHA256CTX *pCtx, uint64_t n )
 {
-	addBuffer("0.1 W ");
-
-	addMove(x0, y0);
-	addLine(x0 + width, y0);
-	addLine(x0 + width, y0 + height);
-	addLine(x0, y0 + height);
+	unsigned char c[8];
+	int i;
 
-	addBuffer("closepath S ");
+	for ( i = 0; i < 8; i++ )
+		c[i] = (unsigned char) (n >> (56 - 8 * i));
+	sha256Update(pCtx, c, 8);
 }
 
-void addRectCenter( double x, double y, double width, double height )
+static void hashDouble( SHA256CTX *pCtx, double x )
 {
-	double a, b, x0, y0;
-	a = width / 2.0;
-	b = height / 2.0;
-	x0 = x - a;
-	y0 = y - b;
+	uint64_t n;
 
-	addBuffer("0.1 W ");
+	if ( x == 0.0 )
+		x = 0.0;                /* Fold -0.0 into 0.0 */
+	memcpy(&n, &x, sizeof(n));
+	hash64(pCtx, n);
+}
 
-	addMove(x0, y0);
-	addLine(x0 + width, y0);
-	addLine(x0 + width, y0 + height);
-	addLine(x0, y0 + height);
+static void hashLong( SHA256CTX *pCtx, long n )
+{
+	hash64(pCtx, (uint64_t) (int64_t) n);
+}
 
-	addBuffer("closepath S ");
+static void hashString( SHA256CTX *pCtx, const char *p )
+{
+	hashLong(pCtx, (long) strlen(p));
+	sha256Update(pCtx, p, strlen(p));
 }
 
-char szPaperSizes[9][16] =
-{ "letter", "a4", "legal", "a3", "11x17", "a1", "archD", "a0", "b0" };
+/* Compute the cache key for the panel currently in the tables */
+void hashPanel( char *szKey )
+{
+	SHA256CTX ctx;
+	int i;
 
-double fPaperWidths[9] =
-{ 21.59, 20.9903, 21.59, 29.7039, 27.94, 59.4078, 60.96, 93.9611, 100.048 };
+	sha256Init(&ctx);
+	/* The build time too, so a changed renderer never finds old output */
+	hashString(&ctx, "rcrpanel " REVISION " " __DATE__ " " __TIME__);
+	hashString(&ctx, "format=ps");
+	hashLong(&ctx, nCompact);
+	if ( nCompact )
+		hashLong(&ctx, nCompactDigits);
+	if ( fTolerance > 0.0 )
+	{
+		hashDouble(&ctx, fTolerance);
+		hashDouble(&ctx, fResolution);
+	}
+	if ( nTilePaper >= 0 )
+	{
+		hashLong(&ctx, nTilePaper);
+		hashDouble(&ctx, fTileOverlap);
+	}
+	hashString(&ctx, szFilename);
+	hashDouble(&ctx, fPanelWidth);
+	hashDouble(&ctx, fPanelHeight);
+	hashLong(&ctx, crBackground);
+	hashLong(&ctx, nReverse);
 
-double fPaperHeights[9] =
-{ 27.94, 29.7039, 35.56, 41.9806, 43.18, 83.9611, 91.44, 118.816, 141.393 };
+	hashLong(&ctx, nNumControls);
+	for ( i = 0; i < nNumControls; i++ )
+	{
+		hashDouble(&ctx, rcControl[i].x);
+		hashDouble(&ctx, rcControl[i].y);
+		hashDouble(&ctx, rcControl[i].diam);
+	}
+	hashLong(&ctx, nNumRectangles);
+	for ( i = 0; i < nNumRectangles; i++ )
+	{
+		hashDouble(&ctx, rcRectangle[i].x0);
+		hashDouble(&ctx, rcRectangle[i].y0);
+		hashDouble(&ctx, rcRectangle[i].fRectangleWidth);
+		hashDouble(&ctx, rcRectangle[i].fRectangleHeight);
+	}
+	hashLong(&ctx, nNumCtrRectangles);
+	for ( i = 0; i < nNumCtrRectangles; i++ )
+	{
+		hashDouble(&ctx, rcRectCenter[i].x);
+		hashDouble(&ctx, rcRectCenter[i].y);
+		hashDouble(&ctx, rcRectCenter[i].fRectangleWidth);
+		hashDouble(&ctx, rcRectCenter[i].fRectangleHeight);
+	}
+	hashLong(&ctx, nNumDials);
+	for ( i = 0; i < nNumDials; i++ )
+	{
+		hashDouble(&ctx, rcDial[i].x0);
+		hashDouble(&ctx, rcDial[i].y0);
+		hashDouble(&ctx, rcDial[i].fRadius);
+		hashDouble(&ctx, rcDial[i].fSpan);
+		hashLong(&ctx, rcDial[i].nNumTicks);
+		hashLong(&ctx, rcDial[i].nBigPer);
+		hashDouble(&ctx, rcDial[i].fSizeTicks);
+		hashDouble(&ctx, rcDial[i].fSizeBig);
+		hashLong(&ctx, rcDial[i].crCircle);
+		hashLong(&ctx, rcDial[i].crTickMarks);
+		hashLong(&ctx, rcDial[i].crBigTickMarks);
+		hashLong(&ctx, rcDial[i].crText);
+		hashDouble(&ctx, rcDial[i].fSizeFont);
+		hashDouble(&ctx, rcDial[i].fStartingIndicator);
+		hashDouble(&ctx, rcDial[i].fIncrementPerBigTick);
+		hashDouble(&ctx, rcDial[i].fStartAngle);
+	}
+	hashLong(&ctx, nNumStrings);
+	for ( i = 0; i < nNumStrings; i++ )
+	{
+		hashDouble(&ctx, rcText[i].x);
+		hashDouble(&ctx, rcText[i].y);
+		hashDouble(&ctx, rcText[i].size);
+		hashLong(&ctx, rcText[i].crColor);
+		hashString(&ctx, rcText[i].szFont);
+		hashString(&ctx, rcText[i].szString);
+	}
 
-void CalcPageSize( void )
+	/* Text placed from font metrics moves when the metrics do */
+	loadFonts();
+	for ( i = 0; i < nNumFontMetrics; i++ )
+		if ( pFontMetrics[i].nFound )
+		{
+			hashString(&ctx, pFontMetrics[i].szName);
+			sha256Update(&ctx, pFontMetrics[i].nWidth, sizeof(pFontMetrics[i].nWidth));
+		}
+	sha256Final(&ctx, szKey);
+}
+
+/* Copy an open file to a descriptor, in the kernel where possible */
+static int streamFile( int fdIn, int fdOut )
 {
-	// double fPrintableWidth;
-	// double fPrintableHeight;
-	// char szPagesize[32];
-	int nPage;
-	int i;
+	struct stat st;
+	off_t nOffset;
+	ssize_t r;
+	char buf[65536];
 
-	// Values in paper table are from gs_statd.ps and need to be converted
-	// Assumption is 12.7 mm margin all around (0.5 in)
-	for ( i = 0; i < 9; i++ )
+	if ( fstat(fdIn, &st) )
+		return -1;
+	nOffset = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+	while ( nOffset < st.st_size )
+	{
+		r = copy_file_range(fdIn, &nOffset, fdOut, NULL, st.st_size - nOffset, 0);
+		if ( r <= 0 )
+			break;
+	}
+#endif
+#ifdef HAVE_SENDFILE
+	while ( nOffset < st.st_size )
 	{
-		fPaperWidths[i] = 10.0 * fPaperWidths[i] - 25.4;
-		fPaperHeights[i] = 10.0 * fPaperHeights[i] - 25.4;
+		r = sendfile(fdOut, fdIn, &nOffset, st.st_size - nOffset);
+		if ( r <= 0 )
+			break;
 	}
+#endif
+	/* Plain copy for whatever the kernel would not do */
+	if ( lseek(fdIn, nOffset, SEEK_SET) < 0 )
+		return -1;
+	while ( (r = read(fdIn, buf, sizeof(buf))) > 0 )
+		if ( writeFully(fdOut, buf, r) )
+			return -1;
+	return r < 0 ? -1 : 0;
+}
 
-	// Initially assume we will fit on letter size paper
-	nPage = 0;
-	fPrintableWidth = fPaperWidths[0];
-	fPrintableHeight = fPaperHeights[0];
+typedef struct
+{
+	char szName[80];
+	off_t nSize;
+	time_t tUsed;
+} CACHEENTRY;
 
-	// Now test each paper size to see what we can fit this panel on to
-	for ( i = 0; i < 8; i++ )
+static int compareCacheEntries( const void *a, const void *b )
+{
+	const CACHEENTRY *p = a, *q = b;
+
+	if ( p->tUsed != q->tUsed )
+		return p->tUsed < q->tUsed ? -1 : 1;
+	return strcmp(p->szName, q->szName);
+}
+
+/* Remove least recently used entries until the cache fits in nLimit */
+static void trimCache( char *pszDir, long long nLimit, char *pszKeep )
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	CACHEENTRY *pEntries;
+	size_t nEntries, nSize, n;
+	long long nTotal;
+	char szPath[4096];
+
+	d = opendir(pszDir);
+	if ( d == NULL )
+		return;
+	pEntries = NULL;
+	nEntries = nSize = 0;
+	nTotal = 0;
+	while ( (de = readdir(d)) != NULL )
 	{
-		if ( fPanelHeight > fPrintableWidth )
+		n = strlen(de->d_name);
+		if ( n == 72 && de->d_name[0] == '.' && de->d_name[65] == '.' )
 		{
-			//	  fprintf(stderr,"Panel is too high for %s. (%f > %f)\n",szPaperSizes[nPage],fPanelHeight,fPrintableWidth);
-			nPage = i + 1;
-			fPrintableWidth = fPaperWidths[nPage];
-			fPrintableHeight = fPaperHeights[nPage];
+			/* Temporary file of a render that never finished */
+			snprintf(szPath, sizeof(szPath), "%s/%s", pszDir, de->d_name);
+			if ( !lstat(szPath, &st) && S_ISREG(st.st_mode) && time(NULL) - st.st_mtime > CACHETEMPAGE )
+				unlink(szPath);
+			continue;
 		}
-		if ( fPanelWidth > fPrintableHeight )
+		if ( n != 67 || strcmp(&de->d_name[64], ".ps") )
+			continue;
+		snprintf(szPath, sizeof(szPath), "%s/%s", pszDir, de->d_name);
+		if ( stat(szPath, &st) )
+			continue;
+		if ( nEntries == nSize )
 		{
-			//	  fprintf(stderr,"Panel is too wide for %s. (%f > %f)\n",szPaperSizes[nPage],fPanelWidth,fPrintableHeight);
-			nPage = i + 1;
-			fPrintableWidth = fPaperWidths[nPage];
-			fPrintableHeight = fPaperHeights[nPage];
+			nSize = nSize ? 2 * nSize : 64;
+			pEntries = realloc(pEntries, nSize * sizeof(CACHEENTRY));
+			if ( pEntries == NULL )
+				break;
 		}
+		strcpy(pEntries[nEntries].szName, de->d_name);
+		pEntries[nEntries].nSize = st.st_size;
+		pEntries[nEntries].tUsed = st.st_mtime;
+		nEntries++;
+		nTotal += st.st_size;
 	}
+	closedir(d);
 
-	// Need to have the paper size name for warning at end of program
-	strcpy(szPagesize, szPaperSizes[nPage]);
+	if ( pEntries != NULL && nTotal > nLimit )
+	{
+		qsort(pEntries, nEntries, sizeof(CACHEENTRY), compareCacheEntries);
+		for ( n = 0; n < nEntries && nTotal > nLimit; n++ )
+		{
+			if ( !strcmp(pEntries[n].szName, pszKeep) )
+				continue;
+			snprintf(szPath, sizeof(szPath), "%s/%s", pszDir, pEntries[n].szName);
+			if ( !unlink(szPath) )
+				nTotal -= pEntries[n].nSize;
+		}
+	}
+	free(pEntries);
 }
 
+/* Produce the panel on stdout through the cache in pszDir */
+int renderCached( char *pszDir, long long nLimit )
+{
+	char szKey[65], szName[80], szPath[4096], szTemp[4096];
+	int fd, fdTemp;
+
+	hashPanel(szKey);
+	sprintf(szName, "%s.ps", szKey);
+	snprintf(szPath, sizeof(szPath), "%s/%s", pszDir, szName);
+
+	fd = open(szPath, O_RDONLY);
+	if ( fd >= 0 )
+	{
+		fprintf(stderr, "Cache hit %s\n", szKey);
+		futimens(fd, NULL);     /* Mark as recently used */
+		CalcPageSize();
+		fflush(stdout);
+		if ( streamFile(fd, STDOUT_FILENO) )
+		{
+			perror("Copying cached output");
+			close(fd);
+			return 8;
+		}
+		close(fd);
+		return 0;
+	}
+
+	/* Miss, render into a temporary file in the cache and rename it in */
+	mkdir(pszDir, 0777);
+	snprintf(szTemp, sizeof(szTemp), "%s/.%s.XXXXXX", pszDir, szKey);
+	fdTemp = mkstemp(szTemp);
+	if ( fdTemp < 0 || (fOut = fdopen(fdTemp, "w+")) == NULL )
+	{
+		perror("Creating cache file");
+		if ( fdTemp >= 0 )
+			close(fdTemp);
+		fOut = stdout;
+		renderPanel();
+		return 0;
+	}
+	renderPanel();
+	if ( fflush(fOut) || fchmod(fdTemp, 0644) || rename(szTemp, szPath) )
+	{
+		perror("Writing cache file");
+		unlink(szTemp);
+	}
+	else
+		trimCache(pszDir, nLimit, szName);
+	fprintf(stderr, "Cache miss %s\n", szKey);
+
+	lseek(fdTemp, 0, SEEK_SET);
+	fflush(stdout);
+	if ( streamFile(fdTemp, STDOUT_FILENO) )
+	{
+		perror("Copying output");
+		fclose(fOut);
+		fOut = stdout;
+		return 8;
+	}
+	fclose(fOut);
+	fOut = stdout;
+	return 0;
+}
 
 /* Generate a panel */
 int main( int argc, char *argv[] )
 {
-	int i;
-	char szWork[132];
 	FILE *f;
-	double fPanelLeftCorner, fPanelBottomCorner;
+	char *pszSocket;
+	char *pszCache;
+	long long nCacheSize;
+	int nCheck;
+	int nSyncOutput;
+	double fClearance;
+	char *p;
+	int nWorkers;
+	char *pszVars;
+	OUTPUT *pOutputs;
+	int nOutputs;
+	int i;
 
 	/* sign on banner */
-	fprintf(stderr, "rcrpanel Revision: 3.6.1  of %s %s.\n", __DATE__, __TIME__);
+	fprintf(stderr, "rcrpanel Revision: " REVISION "  of %s %s.\n", __DATE__, __TIME__);
 
+	fOut = stdout;
+	fLog = stderr;
 	initParams();
 
+	/* Pick off the options */
+	pszSocket = NULL;
+	pszCache = NULL;
+	nCacheSize = CACHESIZE;
+	nCheck = 0;
+	nSyncOutput = 0;
+	fClearance = 1.0;
+	nWorkers = 0;
+	pOutputs = NULL;
+	nOutputs = 0;
+	pszVars = NULL;
+	nThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	for ( i = 1; i < argc; i++ )
+	{
+		if ( !strcmp("--serve", argv[i]) && i + 1 < argc )
+			pszSocket = argv[++i];
+		else if ( !strncmp("--workers=", argv[i], 10) )
+			nWorkers = atoi(&argv[i][10]);
+		else if ( !strcmp("--check", argv[i]) )
+			nCheck = 1;
+		else if ( !strncmp("--clearance=", argv[i], 12) )
+			fClearance = atof(&argv[i][12]);
+		else if ( !strncmp("--threads=", argv[i], 10) )
+			nThreads = atoi(&argv[i][10]);
+		else if ( !strcmp("--sync-output", argv[i]) )
+			nSyncOutput = 1;
+		else if ( !strcmp("--compact", argv[i]) )
+			nCompact = 1;
+		else if ( !strncmp("--resolution=", argv[i], 13) )
+			fResolution = atof(&argv[i][13]);
+		else if ( !strncmp("--tile=", argv[i], 7) )
+		{
+			for ( nTilePaper = 8; nTilePaper >= 0 && strcmp(szPaperSizes[nTilePaper], &argv[i][7]); nTilePaper-- )
+				;
+			if ( nTilePaper < 0 )
+			{
+				fprintf(stderr, "*** Error, unknown paper %s, use letter, a4, legal, a3, 11x17, a1, archD, a0 or b0 ***\n", &argv[i][7]);
+				return 1;
+			}
+		}
+		else if ( !strncmp("--overlap=", argv[i], 10) )
+		{
+			fTileOverlap = strtod(&argv[i][10], &p);
+			if ( p == &argv[i][10] || (*p != '\0' && strcmp(p, "mm")) || !(fTileOverlap >= 0.0) )
+			{
+				fprintf(stderr, "*** Error, bad overlap %s, give it in mm ***\n", &argv[i][10]);
+				return 1;
+			}
+		}
+		else if ( !strncmp("--afm=", argv[i], 6) )
+			pszAfmPath = &argv[i][6];
+		else if ( !strncmp("--tolerance=", argv[i], 12) )
+		{
+			fTolerance = strtod(&argv[i][12], &p);
+			if ( p == &argv[i][12] || (*p != '\0' && strcmp(p, "mm")) || fTolerance < 0.0 )
+			{
+				fprintf(stderr, "*** Error, bad tolerance %s, give it in mm ***\n", &argv[i][12]);
+				return 1;
+			}
+		}
+		else if ( !strcmp("--out", argv[i]) && i + 1 < argc )
+		{
+			i++;
+			p = strchr(argv[i], ':');
+			if ( p == NULL || findFormat(argv[i], p - argv[i]) < 0 || p[1] == '\0' )
+			{
+				fprintf(stderr, "*** Error, --out needs <format>:<file>, format ps, svg, pdf, drill or gerber ***\n");
+				return 1;
+			}
+			pOutputs = realloc(pOutputs, (nOutputs + 1) * sizeof(OUTPUT));
+			pOutputs[nOutputs].nFormat = findFormat(argv[i], p - argv[i]);
+			pOutputs[nOutputs].pszPath = p + 1;
+			nOutputs++;
+		}
+		else if ( !strcmp("--vars", argv[i]) && i + 1 < argc )
+			pszVars = argv[++i];
+		else if ( !strncmp("--cache=", argv[i], 8) )
+			pszCache = &argv[i][8];
+		else if ( !strncmp("--cache-size=", argv[i], 13) )
+		{
+			nCacheSize = strtoll(&argv[i][13], &p, 10);
+			if ( *p == 'k' || *p == 'K' )
+				nCacheSize <<= 10;
+			else if ( *p == 'M' )
+				nCacheSize <<= 20;
+			else if ( *p == 'G' )
+				nCacheSize <<= 30;
+		}
+		else if ( !strncmp("--", argv[i], 2) )
+		{
+			fprintf(stderr, "*** Error, unknown option %s ***\n", argv[i]);
+			return 1;
+		}
+		else
+			strcpy(szFilename, argv[i]);
+	}
+
+	if ( fResolution <= 0.0 )
+	{
+		fprintf(stderr, "*** Error, bad resolution %f ***\n", fResolution);
+		return 1;
+	}
+	setCompact();
+	if ( nTilePaper >= 0 && fTileOverlap >= (10.0 * fPaperWidths[nTilePaper] - 25.4) / 2.0 )
+	{
+		fprintf(stderr, "*** Error, overlap %f is more than half the %s page ***\n", fTileOverlap, szPaperSizes[nTilePaper]);
+		return 1;
+	}
+	for ( i = 0; nTilePaper >= 0 && i < nOutputs; i++ )
+		if ( pOutputs[i].nFormat != FORMAT_PS )
+		{
+			fprintf(stderr, "*** Error, --tile only works with PostScript output ***\n");
+			return 1;
+		}
+	if ( nTilePaper >= 0 && pszSocket != NULL )
+	{
+		fprintf(stderr, "*** Error, --tile cannot be used with --serve ***\n");
+		return 1;
+	}
+	if ( nOutputs && pszCache != NULL )
+	{
+		fprintf(stderr, "*** Error, --cache only works with output to stdout ***\n");
+		return 1;
+	}
+	if ( pszVars != NULL && (nOutputs || pszCache != NULL || nCheck) )
+	{
+		fprintf(stderr, "*** Error, --vars writes its own files, it cannot be used with --out, --cache or --check ***\n");
+		return 1;
+	}
+
+	if ( pszSocket != NULL )
+		return servePanels( pszSocket, nWorkers );
+
 	/* Open the file and read it, if available */
-	if ( argc < 2 )
+	if ( szFilename[0] == '\0' )
 	{
 		fprintf(stderr, "Usage: %s <panel description file> > <output_file.ps>\r\n", argv[0]);
+		fprintf(stderr, "       %s [--cache=<dir> [--cache-size=<bytes>]] <panel description file>\r\n", argv[0]);
+		fprintf(stderr, "       %s [--compact] [--resolution=<dpi>] [--tolerance=<mm>] [--afm=<dirs>] [--threads=<n>] [--sync-output] <panel description file>\r\n", argv[0]);
+		fprintf(stderr, "       %s --tile=<paper> [--overlap=<mm>] [--threads=<n>] <panel description file>\r\n", argv[0]);
+		fprintf(stderr, "       %s --out <format>:<file> [--out <format>:<file> ...] <panel description file>\r\n", argv[0]);
+		fprintf(stderr, "       %s --vars <variants.csv> [--threads=<n>] <panel description file>\r\n", argv[0]);
+		fprintf(stderr, "       %s --check [--clearance=<mm>] <panel description file>\r\n", argv[0]);
+		fprintf(stderr, "       %s --serve <socket> [--workers=<n>]\r\n", argv[0]);
 		return 1;
 	}
-	else if ( argc > 1 )
-	{	strcpy(szFilename, argv[1]);
+	else if ( pszVars != NULL )
+		return renderVariants( pszVars );
+	else
+	{
 		f = fopen(szFilename, "r");
 		if ( f == NULL )
 		{
 			perror("Opening script file");
 			return 8;
 		}
-		getFile(f);
+		if ( !getFileParallel( f, nThreads ) )
+			getFile(f);
 		fclose(f);
 	}
 
-	CalcPageSize();
-	addHeader();
-
-	memset(szBuffer, 0, sizeof(szBuffer));
+	if ( nCheck )
+		return checkPanel( fClearance ) ? 1 : 0;
 
-	/* Calculate location of panel corner.  */
-	fPanelLeftCorner = (fPrintableHeight - fPanelWidth) / 2.0 + 12.7;
-	fPanelBottomCorner = (fPrintableWidth - fPanelHeight) / 2.0 - fPrintableWidth - 12.7;
-	if ( nReverse )
+	if ( nOutputs )
 	{
-		sprintf(szWork, "90 rotate -2.83464567 2.83464567 scale %f %f translate ", fPanelLeftCorner - fPrintableHeight, fPanelBottomCorner);
-		addBuffer(szWork);
+		i = writeOutputs( pOutputs, nOutputs );
+		free(pOutputs);
+		if ( i )
+			return i;
+	}
+	else if ( pszCache != NULL )
+	{
+		i = renderCached( pszCache, nCacheSize );
+		if ( i )
+			return i;
 	}
 	else
 	{
-		sprintf(szWork, "90 rotate 2.83464567 2.83464567 scale %f %f translate ", fPanelLeftCorner, fPanelBottomCorner);
-		addBuffer(szWork);
+		if ( !nSyncOutput && (f = openAsyncOutput(STDOUT_FILENO)) != NULL )
+			fOut = f;
+		renderPanel();
+		if ( fOut != stdout && fclose(fOut) )
+		{
+			perror("Writing output");
+			return 8;
+		}
+		fOut = stdout;
 	}
 
-	/* Draw panel outline */
-	addBuffer("gsave 0.2 W ");
-
-	addColor( crBackground );
-	addBuffer("newpath ");
-
-	addBuffer("0 0 M ");
-	sprintf(szWork, "%f 0 L ", fPanelWidth);
-	addBuffer(szWork);
-	sprintf(szWork, "%f %f L ", fPanelWidth, fPanelHeight);
-	addBuffer(szWork);
-	sprintf(szWork, "0 %f L ", fPanelHeight);
-	addBuffer(szWork);
-	addBuffer("0 0 L ");
-	addBuffer("closepath fill ");
-
-	addColor(0);
-	addBuffer("0 0 M ");
-	sprintf(szWork, "%f 0 L ", fPanelWidth);
-	addBuffer(szWork);
-	sprintf(szWork, "%f %f L ", fPanelWidth, fPanelHeight);
-	addBuffer(szWork);
-	sprintf(szWork, "0 %f L ", fPanelHeight);
-	addBuffer(szWork);
-	addBuffer("0 0 L ");
-	addBuffer("S ");
-	addBuffer("grestore ");
-
-
-
-	for ( i = 0; i < nNumControls; i++ )
-		addControl( rcControl[i].x, rcControl[i].y, rcControl[i].diam );
-
-	for (int i = 0; i < nNumRectangles; i++)
-		addRectangle( rcRectangle[i].x0, rcRectangle[i].y0, rcRectangle[i].fRectangleWidth, rcRectangle[i].fRectangleHeight );
-
-	for (int i = 0; i < nNumCtrRectangles; i++)
-		addRectCenter( rcRectCenter[i].x, rcRectCenter[i].y, rcRectCenter[i].fRectangleWidth, rcRectCenter[i].fRectangleHeight);
-
-	for ( i = 0; i < nNumDials; i++ )
-		addDial( i );
-
-	for ( i = 0; i < nNumStrings; i++ )
-		addString( i );
-
-	addBuffer("showpage ");
-	purgeBuffer();
-	printf("%%%%Trailer\r\n");
+	if ( nCompact && pszCache == NULL && nBytesOut )
+		fprintf(stderr, "Compact output: %ld bytes, about %ld at full precision (%.1f%% smaller)\n",
+		        nBytesOut, nBytesOut + nBytesSaved, 100.0 * nBytesSaved / (nBytesOut + nBytesSaved));
 
 	if ( strcmp(szPagesize, "letter") )
 		fprintf(stderr, "\n\n***NOTE: When doing ps2pdf use -sPAPERSIZE=%s\n", szPagesize);
+	if ( nTilePaper < 0 && szPagesize[0] && (fPanelHeight > fPrintableWidth || fPanelWidth > fPrintableHeight) )
+		fprintf(stderr, "***NOTE: The panel is bigger than %s and will be cut off, see --tile\n", szPagesize);
 
 	return 0;
 }